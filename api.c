@@ -34,143 +34,439 @@ void restore_key() {
 	fcntl(0, F_SETFL, flags);
 }
 
-int read_key(int secs) {
+// Bytes from stdin go through a buffer and are decoded as a stream, so
+// several keys coalesced into one read() all come out, in order, and a
+// sequence split across reads is completed by the next one.
+#define KEY_SEQ_MAX 16 // longer escape sequences are dropped as KEY_IGNORE
+#define KEY_ESC_WAIT 25000 // us for the rest of a cut sequence, else a lone ESC
+
+static unsigned char keybuf[256];
+static int keylen;
+
+// CSI with parameters p[0..n-1] and final byte c
+static int csi_key(const unsigned char *p, int n, int c) {
+	static const int fkeys[] = {
+		[11] = KEY_F1, [12] = KEY_F2, [13] = KEY_F3, [14] = KEY_F4, [15] = KEY_F5,
+		[17] = KEY_F6, [18] = KEY_F7, [19] = KEY_F8, [20] = KEY_F9, [21] = KEY_F10,
+		[23] = KEY_F11, [24] = KEY_F12
+	};
+	int i, num = 0;
+
+	switch(c) {
+		case 'A':
+			return KEY_UP;
+		case 'B':
+			return KEY_DOWN;
+		case 'C':
+			return KEY_RIGHT;
+		case 'D':
+			return KEY_LEFT;
+		case 'Z':
+			return n ? KEY_IGNORE : KEY_SHIFT_TAB;
+		case '~':
+			for(i = 0; i < n && isdigit(p[i]); i ++) num = num * 10 + p[i] - '0';
+			if(i == 0 || num >= (int) (sizeof(fkeys) / sizeof(fkeys[0])) || !fkeys[num]) return KEY_IGNORE;
+
+			return fkeys[num];
+		default:
+			return KEY_IGNORE;
+	}
+}
+
+// key at the start of s, returns the bytes it takes or 0 if s holds only a
+// part of it
+static int key_decode(const unsigned char *s, int n, int *key) {
+	int i;
+
+	if(s[0] >= 0xc0) { // UTF-8 character
+		i = s[0] >= 0xf0 ? 4 : (s[0] >= 0xe0 ? 3 : 2);
+		if(n < i) return 0;
+
+		*key = KEY_IGNORE;
+		return i;
+	}
+	if(s[0] != 0x1b) {
+		*key = s[0];
+		return 1;
+	}
+
+	if(n < 2) return 0;
+	switch(s[1]) {
+		case 'O':
+			if(n < 3) return 0;
+
+			switch(s[2]) {
+				case 'P':
+					*key = KEY_F1;
+					break;
+				case 'Q':
+					*key = KEY_F2;
+					break;
+				case 'R':
+					*key = KEY_F3;
+					break;
+				case 'S':
+					*key = KEY_F4;
+					break;
+				default:
+					*key = KEY_IGNORE;
+					break;
+			}
+			return 3;
+		case '[':
+			break;
+		default: // alt + char
+			*key = s[1] | KEY_ALT;
+			return 2;
+	}
+
+	if(n < 3) return 0;
+	if(s[2] == '[') { // linux console F1..F5
+		if(n < 4) return 0;
+
+		*key = (s[3] >= 'A' && s[3] <= 'E') ? KEY_F1 + (s[3] - 'A') * (KEY_F2 - KEY_F1) : KEY_IGNORE;
+		return 4;
+	}
+
+	// parameter and intermediate bytes up to the final one
+	for(i = 2; i < n && s[i] >= 0x20 && s[i] < 0x40; i ++);
+	if(i == n) {
+		if(n < KEY_SEQ_MAX) return 0;
+
+		*key = KEY_IGNORE;
+		return n;
+	}
+	if(s[i] < 0x40 || s[i] > 0x7e) { // cut short by some other byte
+		*key = KEY_IGNORE;
+		return i;
+	}
+
+	*key = i < KEY_SEQ_MAX ? csi_key(s + 2, i - 2, s[i]) : KEY_IGNORE;
+	return i + 1;
+}
+
+// a sequence that never got its rest: a lone ESC, alt + char or nothing
+static int key_partial(const unsigned char *s, int n, int *key) {
+	if(s[0] == 0x1b && n <= 2) *key = n == 1 ? 0x1b : (s[1] | KEY_ALT);
+	else *key = KEY_IGNORE;
+
+	return n;
+}
+
+// up to max keys out of the buffer; a partial sequence at its end waits
+// for the next read unless flush
+static int key_drain(int *keys, int max, int flush) {
+	int n = 0, i = 0, len;
+
+	while(n < max && i < keylen) {
+		len = key_decode(keybuf + i, keylen - i, keys + n);
+		if(len == 0) {
+			if(!flush) break;
+
+			len = key_partial(keybuf + i, keylen - i, keys + n);
+		}
+		i += len;
+		n ++;
+	}
+
+	memmove(keybuf, keybuf + i, keylen - i);
+	keylen -= i;
+
+	return n;
+}
+
+// 1 when stdin turns readable within usecs, 0 on timeout, -errno on errors;
+// restart keeps waiting through signals
+static int key_wait(long usecs, int restart) {
 	struct timeval tv;
 	fd_set set;
-	unsigned char buf[16];
 	int ret;
 
-	FD_ZERO(&set);
-	FD_SET(0, &set); // 0 => stdin
+	tv.tv_sec = usecs / 1000000;
+	tv.tv_usec = usecs % 1000000;
 
-	tv.tv_sec = secs;
-	tv.tv_usec = 0;
+	do {
+		FD_ZERO(&set);
+		FD_SET(0, &set); // 0 => stdin
 
-	ret = select(1, &set, NULL, NULL, &tv);
-	if(ret == 0) {
-		return 0;
-	} else if(ret < 0) {
+		ret = select(1, &set, NULL, NULL, &tv); // tv keeps the time left
+	} while(ret < 0 && errno == EINTR && restart);
+
+	if(ret < 0) {
 		if(errno == EINTR || errno == EINVAL) {
 			return 0;
 		} else {
 			return -errno;
 		}
 	}
+	return ret > 0;
+}
+
+static int key_fill(void) {
+	int ret;
+
+	ret = read(0, keybuf + keylen, sizeof(keybuf) - keylen);
+	if(ret < 0) {
+		if(errno == EAGAIN || errno == EINTR) return 0;
 
-	ret = read(0, buf, sizeof(buf));
-	if(ret <= 0) {
 		return -errno;
+	} else if(ret == 0) {
+		return -EPIPE; // end of input
 	}
 
 #ifdef DEBUG_KEY
 	dprintf(2, "%d\033[31m", ret);
 	for(int i=0; i < ret; i++) {
-		if(isprint(buf[i])) {
-			dprintf(2, " %c", buf[i]);
+		if(isprint(keybuf[keylen + i])) {
+			dprintf(2, " %c", keybuf[keylen + i]);
 		} else {
-			dprintf(2, " %02x", buf[i]);
+			dprintf(2, " %02x", keybuf[keylen + i]);
 		}
 	}
 	dprintf(2, "\033[0m\n");
 #endif
 
-	switch(ret) {
-		case 1:
-			return buf[0];
-		case 2: // alt + char
-			if(buf[0] != 0x1b) return KEY_IGNORE;
-
-			return (buf[1] & 0xff) | 0x100;
-		case 3:
-			if(buf[0] != 0x1b) return KEY_IGNORE;
-			
-			switch(buf[1]) {
-				case 'O':
-					switch(buf[2]) {
-						case 'P':
-							return KEY_F1;
-						case 'Q':
-							return KEY_F2;
-						case 'R':
-							return KEY_F3;
-						case 'S':
-							return KEY_F4;
-						default:
-							return KEY_IGNORE;
-					}
-					break;
-				case '[':
-					switch(buf[2]) {
-						case 'A':
-							return KEY_UP;
-						case 'B':
-							return KEY_DOWN;
-						case 'C':
-							return KEY_RIGHT;
-						case 'D':
-							return KEY_LEFT;
-						case 'Z':
-							return KEY_SHIFT_TAB;
-						default:
-							return KEY_IGNORE;
-					}
-					break;
-				default:
-					return KEY_IGNORE;
-			}
-		case 4:
-		case 5:
-			if(buf[0] != 0x1b || buf[1] != '[') return KEY_IGNORE;
-			
-			switch(buf[2]) {
-				case '[':
-					switch(buf[3]) {
-						case 'A':
-							return KEY_F1;
-						case 'B':
-							return KEY_F2;
-						case 'C':
-							return KEY_F3;
-						case 'D':
-							return KEY_F4;
-						case 'E':
-							return KEY_F5;
-						default:
-							return KEY_IGNORE;
-					}
-				case '1':
-					if(ret == 5 && buf[4] != '~') return KEY_IGNORE;
-
-					switch(buf[3]) {
-						case '7':
-							return KEY_F6;
-						case '8':
-							return KEY_F7;
-						case '9':
-							return KEY_F8;
-						default:
-							return KEY_IGNORE;
-					}
-				case '2':
-					if(ret == 5 && buf[4] != '~') return KEY_IGNORE;
-
-					switch(buf[3]) {
-						case '0':
-							return KEY_F9;
-						case '1':
-							return KEY_F10;
-						case '3':
-							return KEY_F11;
-						case '4':
-							return KEY_F12;
-						default:
-							return KEY_IGNORE;
-					}
-				default:
-					return KEY_IGNORE;
-			}
-		default:
-			return KEY_IGNORE;
+	keylen += ret;
+	return ret;
+}
+
+int read_keys(int *keys, int max, int secs) {
+	int n, ret;
+
+	if(max <= 0) return 0;
+	if((n = key_drain(keys, max, 0))) return n; // left from the last read
+
+	ret = key_wait(secs * 1000000L, 0);
+	if(ret <= 0) return ret < 0 ? ret : key_drain(keys, max, 1);
+
+	for(;;) {
+		if((ret = key_fill()) < 0) return ret;
+
+		n = key_drain(keys, max, 0);
+		if(n == max || keylen == 0) return n;
+
+		// the rest of a cut sequence follows at once or not at all
+		if((ret = key_wait(KEY_ESC_WAIT, 1)) < 0) return ret;
+		if(ret == 0) return n + key_drain(keys + n, max - n, 1);
+		if(n) return n;
 	}
 }
 
+int read_key(int secs) {
+	int key, ret;
+
+	ret = read_keys(&key, 1, secs);
+	return ret > 0 ? key : ret;
+}
+
+// Keys stamped with CLOCK_MONOTONIC and queued for the game in a ring:
+// feed_input() and feed_evdev() put them in when their fds are readable,
+// the same loop takes them out, all on one thread.
+#define INPUT_RING 256 // power of two
+
+static key_event_t ring[INPUT_RING];
+static unsigned int ring_head, ring_tail;
+static input_stats_t stats;
+
+unsigned long long monotonic_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void push_input(int key, unsigned long long ns) {
+	unsigned int depth = ring_head - ring_tail;
+
+	if(depth == INPUT_RING) {
+		stats.dropped ++;
+		return;
+	}
+
+	ring[ring_head & (INPUT_RING - 1)].key = key;
+	ring[ring_head & (INPUT_RING - 1)].ns = ns;
+	ring_head ++;
+
+	stats.events ++;
+	if(depth + 1 > stats.max_depth) stats.max_depth = depth + 1;
+}
+
+static unsigned long long key_due; // a cut sequence is taken as it is from here, 0 none
+
+// the keys waiting on stdin into the ring, for a loop that watches stdin;
+// never blocks, a cut sequence waits in the buffer until input_wait() is up
+int feed_input(void) {
+	int keys[16], i, n, ret, fed = 0;
+	unsigned long long ns;
+
+	do {
+		ret = key_fill();
+		ns = monotonic_ns();
+
+		// no more bytes came for it, or none ever will
+		while((n = key_drain(keys, sizeof(keys) / sizeof(keys[0]), ret < 0 || (ret == 0 && key_due && ns >= key_due))) > 0) {
+			for(i = 0; i < n; i ++) push_input(keys[i], ns);
+			fed += n;
+		}
+		if(ret > 0) key_due = ns + KEY_ESC_WAIT * 1000ull;
+	} while(ret > 0);
+
+	if(keylen == 0) key_due = 0;
+	if(ret < 0) {
+		push_input(ret, ns);
+		return ret;
+	}
+	return fed;
+}
+
+int input_wait(void) {
+	unsigned long long ns;
+
+	if(key_due == 0) return -1;
+
+	ns = monotonic_ns();
+	return ns >= key_due ? 0 : (key_due - ns + 999999) / 1000000;
+}
+
+int pop_input(key_event_t *ev) {
+	unsigned long long lat;
+
+	stats.depth = ring_head - ring_tail;
+	if(stats.depth == 0) return 0;
+
+	*ev = ring[ring_tail ++ & (INPUT_RING - 1)];
+
+	lat = monotonic_ns() - ev->ns;
+	stats.popped ++;
+	stats.latency_sum += lat;
+	if(lat > stats.latency_max) stats.latency_max = lat;
+
+	return 1;
+}
+
+void input_stats(input_stats_t *st) {
+	*st = stats;
+}
+
+// Input-to-photon tracing: a key is stamped when read, when dispatched, when
+// the frame it caused is drawn and when that frame is on screen after
+// fb_sync(); keys that draw nothing, e.g. moves into a wall, are only counted.
+#define TRACE_MAX (1 << 20)
+
+typedef struct {
+	int key;
+	unsigned long long read, dispatch, render, sync;
+} trace_t;
+
+static trace_t *traces;
+static int trace_num, trace_max, trace_pending; // [trace_pending, trace_num) wait for a frame
+static int trace_idle;
+
+void trace_key(const key_event_t *ev) {
+	trace_t *t;
+
+	if(trace_num == trace_max) {
+		if(trace_max == TRACE_MAX) return;
+
+		t = (trace_t*) realloc(traces, (trace_max ? trace_max * 2 : 256) * sizeof(trace_t));
+		if(t == NULL) return;
+
+		traces = t;
+		trace_max = trace_max ? trace_max * 2 : 256;
+	}
+
+	t = traces + trace_num ++;
+	t->key = ev->key;
+	t->read = ev->ns;
+	t->dispatch = monotonic_ns();
+	t->render = t->sync = 0;
+}
+
+void trace_end(void) {
+	if(trace_num > trace_pending && !traces[trace_num - 1].render) {
+		trace_num --;
+		trace_idle ++;
+	}
+}
+
+void trace_render(void) {
+	unsigned long long ns = monotonic_ns();
+	int i;
+
+	for(i = trace_pending; i < trace_num; i ++) {
+		if(!traces[i].render) traces[i].render = ns;
+	}
+}
+
+void trace_sync(void) {
+	unsigned long long ns = monotonic_ns();
+
+	for(; trace_pending < trace_num; trace_pending ++) {
+		if(!traces[trace_pending].render) traces[trace_pending].render = ns;
+		traces[trace_pending].sync = ns;
+	}
+}
+
+static int trace_cmp(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long*) a, y = *(const unsigned long long*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+void trace_report(int fd) {
+	static const char *names[] = {"queue", "render", "sync", "total"};
+	static const int bounds[] = {1, 2, 4, 8, 16, 32, 64}; // ms
+	const int nb = sizeof(bounds) / sizeof(bounds[0]);
+	unsigned long long *v;
+	int hist[sizeof(bounds) / sizeof(bounds[0]) + 1] = {0};
+	int i, j, n = trace_pending;
+
+	dprintf(fd, "latency: %d keys on screen, %d waiting, %d drew nothing\n", n, trace_num - n, trace_idle);
+	if(n == 0) return;
+
+	v = (unsigned long long*) malloc(4 * n * sizeof(*v));
+	if(v == NULL) return;
+
+	for(i = 0; i < n; i ++) {
+		v[i] = traces[i].dispatch - traces[i].read;
+		v[n + i] = traces[i].render - traces[i].dispatch;
+		v[2 * n + i] = traces[i].sync - traces[i].render;
+		v[3 * n + i] = traces[i].sync - traces[i].read;
+
+		for(j = 0; j < nb && v[3 * n + i] >= bounds[j] * 1000000ull; j ++);
+		hist[j] ++;
+	}
+
+	dprintf(fd, "%8s %9s %9s %9s %9s (ms)\n", "", "p50", "p95", "p99", "max");
+	for(j = 0; j < 4; j ++) {
+		qsort(v + j * n, n, sizeof(*v), trace_cmp);
+		dprintf(fd, "%8s %9.3lf %9.3lf %9.3lf %9.3lf\n", names[j],
+			v[j * n + n * 50 / 100] / 1e6, v[j * n + n * 95 / 100] / 1e6, v[j * n + n * 99 / 100] / 1e6, v[j * n + n - 1] / 1e6);
+	}
+
+	for(j = 0; j <= nb; j ++) {
+		if(j < nb) dprintf(fd, "%4s%2dms %6d ", "<", bounds[j], hist[j]);
+		else dprintf(fd, "%4s%2dms %6d ", ">=", bounds[nb - 1], hist[j]);
+		for(i = 0; i < hist[j] * 50 / n; i ++) dprintf(fd, "#");
+		dprintf(fd, "\n");
+	}
+
+	free(v);
+}
+
+// one line per key on screen: key, read time, then each stage in ns
+int trace_dump(const char *path) {
+	FILE *fp = fopen(path, "w");
+	int i;
+
+	if(fp == NULL) return -errno;
+
+	fprintf(fp, "key,read,queue,render,sync\n");
+	for(i = 0; i < trace_pending; i ++) {
+		fprintf(fp, "%d,%llu,%llu,%llu,%llu\n", traces[i].key, traces[i].read,
+			traces[i].dispatch - traces[i].read, traces[i].render - traces[i].dispatch, traces[i].sync - traces[i].render);
+	}
+	fclose(fp);
+
+	return 0;
+}
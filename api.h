@@ -22,8 +22,44 @@
 #define KEY_F11 0x1000
 #define KEY_F12 0x1100
 
+// or'ed into keys from a device that reports releases, terminals send none
+#define KEY_PRESS 0x10000
+#define KEY_RELEASE 0x20000
+#define KEY_REPEAT 0x40000
+
 void init_key();
 void restore_key();
 int read_key(int secs);
+int read_keys(int *keys, int max, int secs); // every key decoded from one read
+
+typedef struct {
+	int key; // -errno once input is gone
+	unsigned long long ns; // CLOCK_MONOTONIC when it was read
+} key_event_t;
+
+typedef struct {
+	unsigned long events, dropped, popped;
+	unsigned int depth, max_depth; // queued at the last pop, highest seen
+	unsigned long long latency_sum, latency_max; // ns from read to pop
+} input_stats_t;
+
+unsigned long long monotonic_ns(void);
+
+int feed_input(void); // the keys waiting on stdin into the ring, without blocking
+int input_wait(void); // ms until feed_input() takes a cut sequence as it is, -1 none
+void push_input(int key, unsigned long long ns); // stamped when it was read, dropped when full
+int pop_input(key_event_t *ev); // 0 when nothing is queued
+void input_stats(input_stats_t *st);
+
+void trace_key(const key_event_t *ev); // ev is dispatched now
+void trace_end(void); // ... and handled, forgotten if it drew nothing
+void trace_render(void); // a frame is drawn
+void trace_sync(void); // ... and on screen
+void trace_report(int fd); // p50/p95/p99 per stage and a histogram
+int trace_dump(const char *path); // per-key records as CSV
+
+int init_evdev(const char *path); // an evdev keyboard, grabbed, the fd to watch
+void free_evdev(int fd);
+int feed_evdev(int fd); // its keys into the ring like feed_input(), with the kernel's stamps; < 0 => gone
 
 #endif
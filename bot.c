@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "bot.h"
+
+// Pierre Dellacherie style weights, as tuned by Yiyuan Lee's genetic search
+#define W_HEIGHT -0.510066f
+#define W_LINES 0.760666f
+#define W_HOLES -0.35663f
+#define W_BUMPS -0.184483f
+#define LOST -1e9f
+
+#define BEAM_MAX 32
+#define DEPTH_MAX 6
+#define PLACEMENT_MAX (4 * (WIDTH_SHAPE_NUM + 3))
+#define ROW_PLAY (ROW_FULL & ~ROW_WALLS)
+
+typedef struct {
+	core_t c; // locked, no piece in play
+	bot_move_t move;
+	float score; // the board alone
+} node_t;
+
+typedef struct {
+	pthread_t tid;
+	unsigned int gen;
+} bot_worker_t;
+
+static int beam = 8, depth = 3;
+static int lines0; // the lines before the plan, the score counts the ones after
+
+// a job per node of the first beam, any thread takes the next one
+static node_t jobs[BEAM_MAX];
+static float job_value[BEAM_MAX];
+static unsigned long long job_evals[BEAM_MAX];
+static int job_num;
+static atomic_int job_next;
+
+static bot_worker_t *workers = NULL;
+static int worker_num = 1;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned int pool_gen = 0;
+static int pool_busy = 0;
+static bool pool_exit = false;
+
+static bot_stats_t stats;
+
+static unsigned long long bot_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the board's features walked down the rows: a column's height is set by
+// its first cell, every empty cell under one is a hole
+static float bot_eval(const core_t *c) {
+	unsigned int covered = 0, row, fresh;
+	int h[WIDTH_SHAPE_NUM] = {0}, x, y, height = 0, holes = 0, bumps = 0;
+
+	if(c->y < 0) return LOST; // locked above the board
+
+	for(y = 0; y < HEIGHT_SHAPE_NUM; y ++) {
+		row = c->rows[y] & ROW_PLAY;
+		holes += __builtin_popcount(covered & ~row);
+		for(fresh = row & ~covered; fresh; fresh &= fresh - 1)
+			h[12 - __builtin_ctz(fresh)] = HEIGHT_SHAPE_NUM - y;
+		covered |= row;
+	}
+	for(x = 0; x < WIDTH_SHAPE_NUM; x ++) {
+		height += h[x];
+		if(x) bumps += abs(h[x] - h[x - 1]);
+	}
+
+	return W_HEIGHT * height + W_LINES * (c->lines - lines0) + W_HOLES * holes + W_BUMPS * bumps;
+}
+
+// every placement of the piece in play as its keys would make it: turned
+// at the top, shifted as far as it goes each way, dropped and locked
+static int bot_expand(const core_t *c, node_t *out, unsigned long long *evals) {
+	int turned[4][3], n = 0, d = 0, turns, k, s, left, right;
+	core_t t;
+
+	for(turns = 0; turns < 4; turns ++) {
+		t = *c;
+		for(k = 0; k < turns && core_turn(&t); k ++);
+		if(k < turns) break; // the turns after it go through this one
+
+		// the O turns in place
+		for(k = 0; k < d && (turned[k][0] != t.shape || turned[k][1] != t.x || turned[k][2] != t.y); k ++);
+		if(k < d) continue;
+		turned[d][0] = t.shape;
+		turned[d][1] = t.x;
+		turned[d][2] = t.y;
+		d ++;
+
+		for(left = 0; core_fits(&t, t.shape, t.x - left - 1, t.y); left ++);
+		for(right = 0; core_fits(&t, t.shape, t.x + right + 1, t.y); right ++);
+		for(s = -left; s <= right; s ++) {
+			node_t *o = &out[n ++];
+
+			o->c = t;
+			o->c.x += s;
+			core_drop(&o->c);
+			core_lock(&o->c);
+			o->move.turns = turns;
+			o->move.shift = s;
+			o->score = bot_eval(&o->c);
+		}
+	}
+	*evals += n;
+
+	return n;
+}
+
+static int bot_cmp(const void *a, const void *b) {
+	float d = ((const node_t*) b)->score - ((const node_t*) a)->score;
+
+	return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+static float bot_spawn(const core_t *c, int piece, int plies, unsigned long long *evals);
+
+// the best score plies pieces on from c, a piece in play; the beam of its
+// placements is searched on with every piece, none is known past the preview
+static float bot_search(const core_t *c, int plies, unsigned long long *evals) {
+	node_t nodes[PLACEMENT_MAX];
+	float best = LOST, v;
+	int n, i, p;
+
+	n = bot_expand(c, nodes, evals);
+	if(n == 0) return LOST;
+	qsort(nodes, n, sizeof(nodes[0]), bot_cmp);
+	if(plies == 1) return nodes[0].score;
+
+	for(i = 0; i < n && i < beam && nodes[i].score > LOST; i ++) {
+		for(v = 0, p = 0; p < SHAPE_NUM; p ++) v += bot_spawn(&nodes[i].c, p, plies - 1, evals);
+		v /= SHAPE_NUM;
+		if(v > best) best = v;
+	}
+	return best;
+}
+
+static float bot_spawn(const core_t *c, int piece, int plies, unsigned long long *evals) {
+	core_t t = *c;
+
+	t.nextPiece = piece;
+	if(!core_spawn(&t)) return LOST;
+	return bot_search(&t, plies, evals);
+}
+
+static void pool_run(void) {
+	int j;
+
+	while((j = atomic_fetch_add(&job_next, 1)) < job_num) {
+		job_evals[j] = 0;
+		job_value[j] = jobs[j].score <= LOST ? LOST : bot_spawn(&jobs[j].c, jobs[j].c.nextPiece, depth - 1, &job_evals[j]);
+	}
+}
+
+static void *pool_main(void *arg) {
+	bot_worker_t *w = (bot_worker_t*) arg;
+
+	for(;;) {
+		pthread_mutex_lock(&pool_lock);
+		while(w->gen == pool_gen && !pool_exit) pthread_cond_wait(&pool_cond, &pool_lock);
+		if(pool_exit) {
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		w->gen = pool_gen;
+		pthread_mutex_unlock(&pool_lock);
+
+		pool_run();
+
+		pthread_mutex_lock(&pool_lock);
+		if(--pool_busy == 0) pthread_cond_signal(&pool_done);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	return NULL;
+}
+
+void bot_free(void) {
+	int i;
+
+	if(workers) {
+		pthread_mutex_lock(&pool_lock);
+		pool_exit = true;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+
+		for(i = 1; i < worker_num; i ++) pthread_join(workers[i].tid, NULL);
+
+		pool_exit = false;
+		free(workers);
+		workers = NULL;
+	}
+	worker_num = 1;
+}
+
+int bot_init(int threads, int width, int plies) {
+	int i;
+
+	bot_free();
+	memset(&stats, 0, sizeof(stats));
+
+	beam = width < 1 ? 1 : width > BEAM_MAX ? BEAM_MAX : width;
+	depth = plies < 1 ? 1 : plies > DEPTH_MAX ? DEPTH_MAX : plies;
+
+	if(threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 1) return 0;
+
+	workers = (bot_worker_t*) calloc(threads, sizeof(bot_worker_t));
+	if(workers == NULL) return -1;
+
+	for(i = 1; i < threads; i ++) {
+		workers[i].gen = pool_gen;
+		if(pthread_create(&workers[i].tid, NULL, pool_main, &workers[i])) {
+			perror("pthread_create");
+			break;
+		}
+		worker_num ++;
+	}
+
+	return 0;
+}
+
+// the first beam is fanned out, each of its nodes searched on by one
+// thread; the same plan comes out for any number of them
+bool bot_plan(const core_t *c, bot_move_t *move) {
+	node_t nodes[PLACEMENT_MAX];
+	unsigned long long t = bot_ns();
+	float best = LOST;
+	int n, i, pick = 0;
+
+	if(c->shape == 0) return false;
+
+	lines0 = c->lines;
+	n = bot_expand(c, nodes, &stats.evals);
+	if(n == 0) return false;
+	qsort(nodes, n, sizeof(nodes[0]), bot_cmp);
+
+	job_num = depth == 1 ? 0 : n < beam ? n : beam;
+	memcpy(jobs, nodes, job_num * sizeof(nodes[0]));
+	atomic_store(&job_next, 0);
+
+	if(worker_num > 1 && job_num > 1) {
+		pthread_mutex_lock(&pool_lock);
+		pool_busy = worker_num - 1;
+		pool_gen ++;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+
+		pool_run();
+
+		pthread_mutex_lock(&pool_lock);
+		while(pool_busy) pthread_cond_wait(&pool_done, &pool_lock);
+		pthread_mutex_unlock(&pool_lock);
+	} else {
+		pool_run();
+	}
+
+	for(i = 0; i < job_num; i ++) {
+		stats.evals += job_evals[i];
+		if(job_value[i] > best) {
+			best = job_value[i];
+			pick = i;
+		}
+	}
+	*move = nodes[pick].move;
+
+	stats.plans ++;
+	stats.ns += bot_ns() - t;
+	return true;
+}
+
+void bot_stats(bot_stats_t *st) {
+	*st = stats;
+}
@@ -0,0 +1,28 @@
+#ifndef _BOT_H
+#define _BOT_H
+
+#include "core.h"
+
+// A player for a core_t: every placement of the piece in play is scored
+// on aggregate height, holes, bumpiness and lines, and a beam of the best
+// is searched depth pieces on, the preview piece and then every piece.
+// The beam is shared out over a pool of search threads.
+
+typedef struct {
+	int turns; // clockwise, first
+	int shift; // then left (< 0) or right, then the drop
+} bot_move_t;
+
+typedef struct {
+	unsigned long plans;
+	unsigned long long evals; // placements scored
+	unsigned long long ns; // in bot_plan()
+} bot_stats_t;
+
+int bot_init(int threads, int beam, int depth); // threads 0 => all cores; -1 on failure
+void bot_free(void);
+
+bool bot_plan(const core_t *c, bot_move_t *move); // false => no placement
+void bot_stats(bot_stats_t *st);
+
+#endif
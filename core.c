@@ -0,0 +1,236 @@
+#include <string.h>
+
+#include "core.h"
+
+// Each piece's turns in its box are worked out by the compiler: clockwise
+// cell (x, y) comes from (3 - y, x), half a turn from (3 - x, 3 - y),
+// anticlockwise from (y, 3 - x).
+#define TURN(p, x, y, fx, fy) ((p) & SHAPE_BIT(fx, fy) ? SHAPE_BIT(x, y) : 0)
+#define TURN_CW(p, x, y) TURN(p, x, y, 3 - (y), x)
+#define TURN_HALF(p, x, y) TURN(p, x, y, 3 - (x), 3 - (y))
+#define TURN_CCW(p, x, y) TURN(p, x, y, y, 3 - (x))
+#define TURN_ROW(f, p, y) (f(p, 0, y) | f(p, 1, y) | f(p, 2, y) | f(p, 3, y))
+#define TURN_ALL(f, p) (TURN_ROW(f, p, 0) | TURN_ROW(f, p, 1) | TURN_ROW(f, p, 2) | TURN_ROW(f, p, 3))
+#define TURNS(p) {p, TURN_ALL(TURN_CW, p), TURN_ALL(TURN_HALF, p), TURN_ALL(TURN_CCW, p)}
+
+// SRS wall kicks for a clockwise turn from each state, y down: the offsets
+// are tried in order and the first that fits wins
+enum {KICKS_JLSTZ, KICKS_I};
+#define KICK_NUM 5
+static const signed char KICKS[][4][KICK_NUM][2] = {
+	{
+		{{0, 0}, {-1, 0}, {-1, -1}, {0, 2}, {-1, 2}},
+		{{0, 0}, {1, 0}, {1, 1}, {0, -2}, {1, -2}},
+		{{0, 0}, {1, 0}, {1, -1}, {0, 2}, {1, 2}},
+		{{0, 0}, {-1, 0}, {-1, 1}, {0, -2}, {-1, -2}}
+	}, {
+		{{0, 0}, {-2, 0}, {1, 0}, {-2, 1}, {1, -2}},
+		{{0, 0}, {-1, 0}, {2, 0}, {-1, -2}, {2, 1}},
+		{{0, 0}, {2, 0}, {-1, 0}, {2, -1}, {-1, 2}},
+		{{0, 0}, {1, 0}, {-2, 0}, {1, 2}, {-2, -1}}
+	}
+};
+
+// the O turns in place, its first offset always fits
+const core_piece_t PIECES[SHAPE_NUM] = {
+	{TURNS(0x4444), KICKS_I},
+	{TURNS(0x4460), KICKS_JLSTZ},
+	{TURNS(0x2260), KICKS_JLSTZ},
+	{TURNS(0x0C60), KICKS_JLSTZ},
+	{TURNS(0x06C0), KICKS_JLSTZ},
+	{TURNS(0x0660), KICKS_JLSTZ},
+	{TURNS(0x04E0), KICKS_JLSTZ}
+};
+const int COLORS[COLOR_NUM] = {0x33, 0x66, 0x99, 0xcc};
+
+void core_rand_seed(core_rand_t *r, unsigned long long seed, bool bag) {
+	unsigned long long z;
+	int i;
+
+	for(i = 0; i < 4; i ++) {
+		z = seed += 0x9e3779b97f4a7c15ull;
+		z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+		r->s[i] = z ^ z >> 31;
+	}
+	r->bag = bag;
+	r->left = 0;
+}
+
+static unsigned long long core_rand_next(core_rand_t *r) {
+	unsigned long long *s = r->s, v = s[1] * 5, t = s[1] << 17;
+
+	v = (v << 7 | v >> 57) * 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = s[3] << 45 | s[3] >> 19;
+
+	return v;
+}
+
+// 0 to n - 1 from the high bits, scaled instead of a division
+static int core_rand_below(core_rand_t *r, int n) {
+	return (core_rand_next(r) >> 32) * n >> 32;
+}
+
+int core_rand_piece(core_rand_t *r) {
+	int i, j;
+
+	if(!r->bag) return core_rand_below(r, SHAPE_NUM);
+
+	if(r->left == 0) { // refilled shuffled, inside-out
+		for(i = 0; i < SHAPE_NUM; i ++) {
+			j = core_rand_below(r, i + 1);
+			r->pieces[i] = r->pieces[j];
+			r->pieces[j] = i;
+		}
+		r->left = SHAPE_NUM;
+	}
+
+	return r->pieces[-- r->left];
+}
+
+int core_rand_color(core_rand_t *r) {
+	return 1 + core_rand_below(r, COLOR_NUM * COLOR_NUM * COLOR_NUM);
+}
+
+void core_seed(core_t *c, unsigned long long seed, bool bag) {
+	memset(c, 0, sizeof(*c));
+	core_rand_seed(&c->rand, seed, bag);
+	c->nextPiece = -1;
+	core_reset(c);
+}
+
+void core_reset(core_t *c) {
+	int y;
+
+	c->grade = MAX_GRADE;
+	c->x = c->y = 0;
+	c->shape = 0;
+	c->color = 0;
+	if(c->nextPiece < 0) c->nextPiece = core_rand_piece(&c->rand);
+	if(c->nextColor == 0) c->nextColor = core_rand_color(&c->rand);
+	c->score = c->lines = 0;
+	c->over = false;
+	for(y = 0; y < HEIGHT_SHAPE_NUM; y ++) c->rows[y] = ROW_WALLS;
+	memset(c->colors, 0, sizeof(c->colors));
+}
+
+bool core_fits(const core_t *c, int shape, int x, int y) {
+	unsigned int m;
+	int i;
+
+	if(x < -3 || x >= WIDTH_SHAPE_NUM) return shape == 0; // every cell off the board
+
+	for(i = 0; i < 4; i ++) {
+		m = SHAPE_ROW(shape, i) << (9 - x);
+		if(m == 0) continue;
+		if(y + i >= HEIGHT_SHAPE_NUM || (m & (y + i < 0 ? ROW_WALLS : c->rows[y + i]))) return false;
+	}
+	return true;
+}
+
+// the piece comes in with its lowest cells just above the board, and the
+// game is over once one was locked there or the next has no room below it
+bool core_spawn(core_t *c) {
+	const int shape = PIECES[c->nextPiece].turns[0];
+	int y;
+
+	if(c->over) return false;
+	if(c->y < 0) goto end;
+
+	for(y = 3; y > 0 && SHAPE_ROW(shape, y) == 0; y --);
+	c->x = (WIDTH_SHAPE_NUM - 4) / 2;
+	c->y = -y - 1;
+
+	if(!core_fits(c, shape, c->x, c->y + 1)) {
+	end:
+		c->shape = 0;
+		c->over = true;
+		return false;
+	}
+	c->piece = c->nextPiece;
+	c->pieces ++;
+	c->turn = 0;
+	c->shape = shape;
+	c->nextPiece = core_rand_piece(&c->rand);
+	c->color = c->nextColor;
+	c->nextColor = core_rand_color(&c->rand);
+
+	c->grade = MAX_GRADE - c->score / MAX_GRADE;
+	if(c->grade < 1) c->grade = 1;
+	return true;
+}
+
+bool core_move(core_t *c, int dx, int dy) {
+	if(!core_fits(c, c->shape, c->x + dx, c->y + dy)) return false;
+
+	c->x += dx;
+	c->y += dy;
+	return true;
+}
+
+bool core_turn(core_t *c) {
+	const signed char (*kick)[2] = KICKS[PIECES[c->piece].kicks][c->turn];
+	int turn = (c->turn + 1) % 4, shape = PIECES[c->piece].turns[turn], k;
+
+	for(k = 0; k < KICK_NUM; k ++) {
+		if(core_fits(c, shape, c->x + kick[k][0], c->y + kick[k][1])) {
+			c->shape = shape;
+			c->turn = turn;
+			c->x += kick[k][0];
+			c->y += kick[k][1];
+			return true;
+		}
+	}
+	return false;
+}
+
+int core_drop(core_t *c) {
+	int n = 0;
+
+	while(core_fits(c, c->shape, c->x, c->y + n + 1)) n ++;
+	c->y += n;
+	return n;
+}
+
+int core_lock(core_t *c) {
+	int x, y, r, low = -1, n = 0;
+	unsigned int m;
+
+	for(y = 0; y < 4; y ++) {
+		m = SHAPE_ROW(c->shape, y) << (9 - c->x);
+		r = c->y + y;
+		if(r < 0 || m == 0) continue;
+
+		c->rows[r] |= m;
+		for(x = 0; x < WIDTH_SHAPE_NUM; x ++)
+			if(ROW_CELL(m, x)) c->colors[r][x] = c->color;
+
+		if(c->rows[r] == ROW_FULL) {
+			low = r;
+			n ++;
+		}
+	}
+	c->shape = 0;
+	if(n == 0) return 0;
+
+	c->score += n * 2 - 1;
+	c->lines += n;
+
+	// compact the rows above the lowest full one down over the full ones
+	for(y = r = low; y >= 0; y --) {
+		if(c->rows[y] == ROW_FULL) continue;
+		if(r != y) {
+			c->rows[r] = c->rows[y];
+			memcpy(c->colors[r], c->colors[y], sizeof(c->colors[r]));
+		}
+		r --;
+	}
+	for(; r >= 0; r --) c->rows[r] = ROW_WALLS;
+
+	return n;
+}
@@ -0,0 +1,71 @@
+#ifndef _CORE_H
+#define _CORE_H
+
+#include <stdbool.h>
+
+// The rules alone: no drawing, no timers and no globals, so any number of
+// games can run side by side. The frontend decides when gravity and keys
+// step a game and draws what is in its core_t.
+
+#define HEIGHT_SHAPE_NUM 20
+#define WIDTH_SHAPE_NUM 10
+#define MAX_GRADE 25
+#define SHAPE_NUM 7
+#define COLOR_NUM 4 // per channel
+
+// A shape is a 4x4 box, cell (x, y) at SHAPE_BIT, row y of it SHAPE_ROW
+// with column 0 at bit 3.
+#define SHAPE_BIT(x, y) (1 << (15 - (x) - 4 * (y)))
+#define SHAPE_ROW(p, y) (((p) >> (12 - 4 * (y))) & 0xf)
+
+// Rows are bitboards, column x at bit 12 - x between three wall columns on
+// either side, so row y of a shape lands at X as SHAPE_ROW << (9 - X) and
+// collides with an AND.
+#define ROW_WALLS 0xe007
+#define ROW_FULL 0xffff
+#define ROW_CELL(row, x) (((row) >> (12 - (x))) & 1)
+
+typedef struct {
+	int turns[4]; // clockwise from the spawn state
+	int kicks;
+} core_piece_t;
+
+extern const core_piece_t PIECES[SHAPE_NUM];
+extern const int COLORS[COLOR_NUM];
+
+// xoshiro256**, seeded through splitmix64 so any seed will do; with bag
+// set the pieces come as shuffled sets of all of them
+typedef struct {
+	unsigned long long s[4];
+	bool bag;
+	int left; // pieces still in the bag
+	unsigned char pieces[SHAPE_NUM];
+} core_rand_t;
+
+typedef struct {
+	unsigned short rows[HEIGHT_SHAPE_NUM];
+	unsigned char colors[HEIGHT_SHAPE_NUM][WIDTH_SHAPE_NUM]; // core_rand_color(), 0 empty
+	int x, y; // the piece's box on the board
+	int shape, piece, turn, color; // shape 0 => no piece
+	int nextPiece, nextColor; // nextPiece -1 => none drawn yet
+	int score, lines, grade; // grade counts down from MAX_GRADE
+	int pieces; // spawned since the seed, over every game
+	bool over;
+	core_rand_t rand;
+} core_t;
+
+void core_rand_seed(core_rand_t *r, unsigned long long seed, bool bag);
+int core_rand_piece(core_rand_t *r);
+int core_rand_color(core_rand_t *r); // one of COLOR_NUM^3 colours as an index from 1
+
+void core_seed(core_t *c, unsigned long long seed, bool bag); // a new game too
+void core_reset(core_t *c); // an empty board, the pieces go on from the seed
+
+bool core_fits(const core_t *c, int shape, int x, int y);
+bool core_spawn(core_t *c); // the next piece in play, false => game over
+bool core_move(core_t *c, int dx, int dy);
+bool core_turn(core_t *c); // clockwise with SRS kicks
+int core_drop(core_t *c); // down as far as it goes, the rows it fell
+int core_lock(core_t *c); // the piece into the board, the lines it cleared
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+// evdev codes, in the order of their keys below
+static const unsigned short EV_CODES[] = {
+	KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_F1, KEY_F2,
+	KEY_KP4, KEY_KP6, KEY_KP8, KEY_KP5, KEY_KP0,
+	KEY_4, KEY_6, KEY_8, KEY_5, KEY_0,
+	KEY_A, KEY_D, KEY_W, KEY_S, KEY_J, KEY_L, KEY_I, KEY_K,
+	KEY_SPACE, KEY_LEFTBRACE, KEY_RIGHTBRACE, KEY_Q, KEY_ESC
+};
+
+// api.h names the terminal keys the same
+#undef KEY_LEFT
+#undef KEY_RIGHT
+#undef KEY_UP
+#undef KEY_DOWN
+#undef KEY_F1
+#undef KEY_F2
+#undef KEY_F3
+#undef KEY_F4
+#undef KEY_F5
+#undef KEY_F6
+#undef KEY_F7
+#undef KEY_F8
+#undef KEY_F9
+#undef KEY_F10
+#undef KEY_F11
+#undef KEY_F12
+
+#include "api.h"
+
+static const int EV_KEYS[] = {
+	KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_F1, KEY_F2,
+	'4', '6', '8', '5', '0',
+	'4', '6', '8', '5', '0',
+	'a', 'd', 'w', 's', 'j', 'l', 'i', 'k',
+	' ', '[', ']', 'q', 0x1b
+};
+
+#define EV_NUM (sizeof(EV_CODES) / sizeof(EV_CODES[0]))
+#define EV_BITS (KEY_MAX / 8 + 1)
+
+// Keys straight from /dev/input/event*: press, release and kernel repeat,
+// stamped by the kernel. One device at a time, fed into the ring from the
+// game's loop when its fd is readable.
+static unsigned char ev_down[EV_BITS]; // keys this side thinks are held
+static long long ev_offset; // from the device clock to CLOCK_MONOTONIC
+static int ev_dropped; // the kernel lost events, skip to the next report
+
+static int ev_key(unsigned int code) {
+	int i;
+
+	for(i = 0; i < EV_NUM; i ++)
+		if(EV_CODES[i] == code) return EV_KEYS[i];
+	return -1;
+}
+
+int init_evdev(const char *path) {
+	int fd, clk = CLOCK_MONOTONIC, grab = 1;
+	struct timespec rt, mt;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0) return -1;
+
+	// realtime stamps are moved over by the clocks' difference now
+	ev_offset = 0;
+	if(ioctl(fd, EVIOCSCLOCKID, &clk)) {
+		clock_gettime(CLOCK_REALTIME, &rt);
+		clock_gettime(CLOCK_MONOTONIC, &mt);
+		ev_offset = (mt.tv_sec - rt.tv_sec) * 1000000000ll + (mt.tv_nsec - rt.tv_nsec);
+	}
+
+	// the console would see the keys too and type them into stdin
+	if(ioctl(fd, EVIOCGRAB, &grab)) perror("EVIOCGRAB");
+
+	memset(ev_down, 0, sizeof(ev_down));
+	ev_dropped = 0;
+
+	return fd;
+}
+
+void free_evdev(int fd) {
+	int grab = 0;
+
+	if(fd < 0) return;
+
+	ioctl(fd, EVIOCGRAB, &grab);
+	close(fd);
+}
+
+static void ev_push(unsigned int code, int value, unsigned long long ns) {
+	int key = ev_key(code);
+
+	if(value == 0) ev_down[code / 8] &= ~(1 << (code % 8));
+	else ev_down[code / 8] |= 1 << (code % 8);
+
+	if(key < 0) return;
+	push_input(key | (value == 0 ? KEY_RELEASE : value == 2 ? KEY_REPEAT : KEY_PRESS), ns);
+}
+
+// after SYN_DROPPED: the changes between what was seen and the device's keys now
+static void ev_resync(int fd) {
+	unsigned char now[EV_BITS];
+	unsigned long long ns = monotonic_ns();
+	unsigned int code;
+
+	if(ioctl(fd, EVIOCGKEY(sizeof(now)), now) < 0) return;
+
+	for(code = 0; code < EV_BITS * 8; code ++) {
+		if(((now[code / 8] ^ ev_down[code / 8]) >> (code % 8)) & 1)
+			ev_push(code, (now[code / 8] >> (code % 8)) & 1, ns);
+	}
+}
+
+// the device's events into the ring, a batch per read; 0 once it is drained,
+// -errno when it is gone, its held keys let go so none stays down
+int feed_evdev(int fd) {
+	struct input_event evs[64];
+	unsigned long long ns;
+	unsigned int code;
+	ssize_t n;
+	int i;
+
+	while((n = read(fd, evs, sizeof(evs))) > 0) {
+		for(i = 0; i < n / sizeof(evs[0]); i ++) {
+			if(evs[i].type == EV_SYN) {
+				if(evs[i].code == SYN_DROPPED) {
+					ev_dropped = 1;
+				} else if(evs[i].code == SYN_REPORT && ev_dropped) {
+					ev_dropped = 0;
+					ev_resync(fd);
+				}
+				continue;
+			}
+			if(ev_dropped || evs[i].type != EV_KEY || evs[i].code > KEY_MAX) continue;
+
+			ns = evs[i].input_event_sec * 1000000000ull + evs[i].input_event_usec * 1000ull + ev_offset;
+			ev_push(evs[i].code, evs[i].value, ns);
+		}
+	}
+	if(n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+	n = n ? -errno : -EPIPE;
+	ns = monotonic_ns();
+	for(code = 0; code < EV_BITS * 8; code ++) {
+		if((ev_down[code / 8] >> (code % 8)) & 1) ev_push(code, 0, ns);
+	}
+	return n;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+// api.h names the terminal keys the same, the evdev codes are kept first
+enum {EV_LEFT = KEY_LEFT, EV_SPACE = KEY_SPACE, EV_X = KEY_X};
+#undef KEY_LEFT
+#undef KEY_RIGHT
+#undef KEY_UP
+#undef KEY_DOWN
+#undef KEY_F1
+#undef KEY_F2
+#undef KEY_F3
+#undef KEY_F4
+#undef KEY_F5
+#undef KEY_F6
+#undef KEY_F7
+#undef KEY_F8
+#undef KEY_F9
+#undef KEY_F10
+#undef KEY_F11
+#undef KEY_F12
+
+#include "api.h"
+
+// The evdev decoder, fed from a pipe and, where /dev/uinput can be opened,
+// from a virtual keyboard through the kernel.
+
+static int fails = 0;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		fails ++; \
+	} \
+} while(0)
+
+static void ev_write(int fd, unsigned long long us, int type, int code, int value) {
+	struct input_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.input_event_sec = us / 1000000;
+	ev.input_event_usec = us % 1000000;
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	if(write(fd, &ev, sizeof(ev)) != sizeof(ev)) perror("write");
+}
+
+static int ui_feed(int fd);
+
+// the next key queued, fed from the device behind fd (>= 0) until it comes
+static void check_key(int fd, int key, unsigned long long ns1, unsigned long long ns2) {
+	key_event_t ev;
+	int n;
+
+	while((n = pop_input(&ev)) == 0 && fd >= 0 && ui_feed(fd) == 0);
+	CHECK(n == 1);
+	CHECK(ev.key == key);
+	CHECK(ev.ns >= ns1 && ev.ns <= ns2);
+}
+
+// events as a device would hand them over, its stamps kept
+static void test_pipe(void) {
+	key_event_t ev;
+	int fds[2];
+
+	if(pipe(fds) || fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+		perror("pipe");
+		fails ++;
+		return;
+	}
+
+	ev_write(fds[1], 1000001, EV_KEY, EV_LEFT, 1);
+	ev_write(fds[1], 1000001, EV_SYN, SYN_REPORT, 0);
+	ev_write(fds[1], 1250000, EV_KEY, EV_LEFT, 2);
+	ev_write(fds[1], 1250000, EV_SYN, SYN_REPORT, 0);
+	ev_write(fds[1], 1300000, EV_KEY, EV_LEFT, 0);
+	ev_write(fds[1], 1300000, EV_KEY, EV_X, 1); // no key of the game
+	ev_write(fds[1], 1300000, EV_KEY, EV_SPACE, 1);
+	ev_write(fds[1], 1300000, EV_SYN, SYN_REPORT, 0);
+
+	CHECK(feed_evdev(fds[0]) == 0);
+	check_key(-1, KEY_LEFT | KEY_PRESS, 1000001000, 1000001000);
+	check_key(-1, KEY_LEFT | KEY_REPEAT, 1250000000, 1250000000);
+	check_key(-1, KEY_LEFT | KEY_RELEASE, 1300000000, 1300000000);
+	check_key(-1, ' ' | KEY_PRESS, 1300000000, 1300000000);
+	CHECK(pop_input(&ev) == 0);
+
+	// lost events are skipped up to the next report
+	ev_write(fds[1], 1400000, EV_SYN, SYN_DROPPED, 0);
+	ev_write(fds[1], 1400000, EV_KEY, EV_LEFT, 1);
+	ev_write(fds[1], 1400000, EV_SYN, SYN_REPORT, 0);
+	CHECK(feed_evdev(fds[0]) == 0);
+	CHECK(pop_input(&ev) == 0);
+
+	// gone, and the space still held is let go
+	close(fds[1]);
+	CHECK(feed_evdev(fds[0]) == -EPIPE);
+	check_key(-1, ' ' | KEY_RELEASE, monotonic_ns() - 1000000000ull, monotonic_ns());
+	CHECK(pop_input(&ev) == 0);
+
+	close(fds[0]);
+}
+
+static void ui_key(int fd, int code, int value) {
+	ev_write(fd, 0, EV_KEY, code, value);
+	ev_write(fd, 0, EV_SYN, SYN_REPORT, 0);
+}
+
+// waits for the events a device has for us, then feeds them
+static int ui_feed(int fd) {
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+
+	if(poll(&p, 1, 1000) <= 0) return -ETIMEDOUT;
+	return feed_evdev(fd);
+}
+
+// /dev/input/eventN of the virtual device, once udev made it
+static int ui_open(int ui) {
+	char sys[64], dir[128], path[300];
+	struct dirent *d;
+	DIR *dp;
+	int i, fd = -1;
+
+	if(ioctl(ui, UI_GET_SYSNAME(sizeof(sys)), sys) < 0) return -1;
+	snprintf(dir, sizeof(dir), "/sys/devices/virtual/input/%s", sys);
+
+	for(i = 0; i < 100 && fd < 0; i ++) {
+		if((dp = opendir(dir))) {
+			while((d = readdir(dp))) {
+				if(strncmp(d->d_name, "event", 5)) continue;
+				snprintf(path, sizeof(path), "/dev/input/%s", d->d_name);
+				fd = init_evdev(path);
+				break;
+			}
+			closedir(dp);
+		}
+		if(fd < 0) usleep(10000);
+	}
+	return fd;
+}
+
+// a keyboard through the kernel: its stamps on our clock, repeat and release
+static bool test_uinput(void) {
+	struct uinput_setup setup;
+	unsigned long long t1, t2;
+	key_event_t ev;
+	int ui, fd, n;
+
+	ui = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	if(ui < 0) {
+		printf("uinput: skipped, %s\n", strerror(errno));
+		return false;
+	}
+
+	memset(&setup, 0, sizeof(setup));
+	setup.id.bustype = BUS_VIRTUAL;
+	strcpy(setup.name, "fbrussia evdevtest");
+	if(ioctl(ui, UI_SET_EVBIT, EV_KEY) || ioctl(ui, UI_SET_KEYBIT, EV_LEFT) || ioctl(ui, UI_SET_KEYBIT, EV_SPACE)
+		|| ioctl(ui, UI_DEV_SETUP, &setup) || ioctl(ui, UI_DEV_CREATE)) {
+		printf("uinput: skipped, %s\n", strerror(errno));
+		close(ui);
+		return false;
+	}
+
+	fd = ui_open(ui);
+	CHECK(fd >= 0);
+	if(fd >= 0) {
+		t1 = monotonic_ns();
+		ui_key(ui, EV_LEFT, 1);
+		ui_key(ui, EV_LEFT, 2);
+		ui_key(ui, EV_LEFT, 0);
+		t2 = monotonic_ns();
+
+		check_key(fd, KEY_LEFT | KEY_PRESS, t1, t2);
+		check_key(fd, KEY_LEFT | KEY_REPEAT, t1, t2);
+		check_key(fd, KEY_LEFT | KEY_RELEASE, t1, t2);
+
+		// unplugged, the space held on it is let go
+		ui_key(ui, EV_SPACE, 1);
+		check_key(fd, ' ' | KEY_PRESS, t2, monotonic_ns());
+		ioctl(ui, UI_DEV_DESTROY);
+		while((n = ui_feed(fd)) == 0);
+		CHECK(n < 0 && n != -ETIMEDOUT);
+		check_key(-1, ' ' | KEY_RELEASE, t2, monotonic_ns());
+		CHECK(pop_input(&ev) == 0);
+
+		free_evdev(fd);
+	}
+	close(ui);
+
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	int n;
+
+	test_pipe();
+	printf("pipe: %s\n", fails ? "FAILED" : "ok");
+
+	n = fails;
+	if(test_uinput()) printf("uinput: %s\n", fails > n ? "FAILED" : "ok");
+
+	return fails ? 1 : 0;
+}
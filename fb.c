@@ -7,6 +7,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <asm/types.h> 
@@ -18,36 +19,95 @@
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 #include "fb.h"
 
-#define FB_ASSERT assert(fb_fd > 0 && fb_addr && fb_newbuf)
+#define FB_ASSERT assert(fb_fd != 0 && fb_addr && fb_newbuf)
 
 int fb_width = 0, fb_height = 0, fb_bpp = 0;
 
-static int fb_fd = 0;
+static int fb_fd = 0; // -1 => headless memory backend
 static char *fb_addr = NULL;
 static int fb_size = 0;
 static int fb_xoffset = 0, fb_xsize = 0;
 static char *fb_oldbuf = NULL, *fb_newbuf = NULL;
 static struct fb_var_screeninfo fb_vinfo;
 
+// the canvas drawn since the last fb_sync() as a span per row, x1 >= x2 when
+// clean; without it every sync copies the whole canvas
+static int *damage = NULL; // x1, x2 per row
+static int damage_y1 = 0, damage_y2 = 0; // the rows with a span
+
+// "mem:WIDTHxHEIGHT[xBPP]" => framebuffer in anonymous memory, no device
+static int mem_vinfo(const char *spec, struct fb_var_screeninfo *vinfo) {
+	int width = 0, height = 0, bpp = 32;
+
+	if(sscanf(spec, "%dx%dx%d", &width, &height, &bpp) < 2 || width <= 0 || height <= 0) return FB_ERR;
+
+	memset(vinfo, 0, sizeof(*vinfo));
+	vinfo->xres = vinfo->xres_virtual = width;
+	vinfo->yres = vinfo->yres_virtual = height;
+	vinfo->bits_per_pixel = bpp;
+
+	switch(bpp) {
+		case 16:
+			vinfo->red.offset = 11;
+			vinfo->red.length = 5;
+			vinfo->green.offset = 5;
+			vinfo->green.length = 6;
+			vinfo->blue.offset = 0;
+			vinfo->blue.length = 5;
+			break;
+		case 24:
+		case 32:
+			vinfo->red.offset = 16;
+			vinfo->red.length = 8;
+			vinfo->green.offset = 8;
+			vinfo->green.length = 8;
+			vinfo->blue.offset = 0;
+			vinfo->blue.length = 8;
+			if(bpp == 32) {
+				vinfo->transp.offset = 24;
+				vinfo->transp.length = 8;
+			}
+			break;
+		default:
+			return FB_ERR;
+	}
+
+	return FB_OK;
+}
+
 static void init_font(void);
+static void init_canvas(void);
 int fb_init(const char *path) {
 	size_t sz;
 
 	assert(fb_fd == 0 && fb_addr == NULL);
 	
-	fb_fd = open(path, O_RDWR);
-	if(fb_fd < 0) {
-		pprintf("open framebuffer device failed");
-		return FB_ERR;
-	}
+	if(!strncmp(path, "mem:", 4)) {
+		if(mem_vinfo(path + 4, &fb_vinfo)) {
+			eprintf("invalid memory framebuffer: %s\n", path);
+			return FB_ERR;
+		}
+		fb_fd = -1;
+	} else {
+		fb_fd = open(path, O_RDWR);
+		if(fb_fd < 0) {
+			pprintf("open framebuffer device failed");
+			fb_fd = 0;
+			return FB_ERR;
+		}
 
-	if(ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_vinfo)) {
-		pprintf("ioctl FBIOGET_VSCREENINFO failed");
-		close(fb_fd);
-		return FB_ERR;
+		if(ioctl(fb_fd, FBIOGET_VSCREENINFO, &fb_vinfo)) {
+			pprintf("ioctl FBIOGET_VSCREENINFO failed");
+			close(fb_fd);
+			fb_fd = 0;
+			return FB_ERR;
+		}
 	}
 
 	fb_width = fb_vinfo.xres;
@@ -60,17 +120,28 @@ int fb_init(const char *path) {
 	fb_newbuf = (char*) malloc(sz);
 	if(fb_newbuf == NULL) {
 		pprintf("malloc fb_newbuf failed");
-		close(fb_fd);
+		if(fb_fd > 0) close(fb_fd);
+		fb_fd = 0;
 		return FB_ERR;
 	}
 	memset(fb_newbuf, 0, sz);
 	dprintf("newbuf size is %.3lfMB\n", sz / 1024.0f / 1024.0f);
 
+	damage = (int*) malloc(fb_height * 2 * sizeof(int));
+	if(damage == NULL) eprintf("malloc damage failed, syncs copy everything\n");
+
 	fb_size = fb_vinfo.xres_virtual * fb_vinfo.yres_virtual * fb_bpp / 8;
-	fb_addr = (char*) mmap(0, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
+	if(fb_fd > 0) fb_addr = (char*) mmap(0, fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
+	else fb_addr = (char*) mmap(0, fb_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 	if(fb_addr == MAP_FAILED) {
 		pprintf("mmap failed");
-		close(fb_fd);
+		free(fb_newbuf);
+		fb_newbuf = NULL;
+		free(damage);
+		damage = NULL;
+		fb_addr = NULL;
+		if(fb_fd > 0) close(fb_fd);
+		fb_fd = 0;
 		return FB_ERR;
 	}
 
@@ -79,6 +150,9 @@ int fb_init(const char *path) {
 #	undef vcolor
 
 	init_font();
+	init_canvas();
+	damage_y2 = 0;
+	fb_damage(0, 0, fb_width, fb_height); // the first sync clears the screen
 
 	return FB_OK;
 }
@@ -116,33 +190,87 @@ static void free_font(void);
 int fb_free(void) {
 	FB_ASSERT;
 	
+	fb_threads(1);
 	free_font();
 	
 	free(fb_newbuf);
 	fb_newbuf = NULL;
+	free(damage);
+	damage = NULL;
 	
 	munmap(fb_addr, fb_size);
 	fb_addr = NULL;
 	fb_size = 0;
 
-	close(fb_fd);
+	if(fb_fd > 0) close(fb_fd);
 	fb_fd = 0;
 
 	return FB_OK;
 }
 
+void fb_damage(int x, int y, int width, int height) {
+	int i;
+
+	if(damage == NULL) return;
+
+	if(x < 0) {
+		width += x;
+		x = 0;
+	}
+	if(y < 0) {
+		height += y;
+		y = 0;
+	}
+	if(x + width > fb_width) width = fb_width - x;
+	if(y + height > fb_height) height = fb_height - y;
+	if(width <= 0 || height <= 0) return;
+
+	// rows outside [damage_y1, damage_y2) hold stale spans, they start over
+	if(damage_y1 >= damage_y2) {
+		damage_y1 = y;
+		damage_y2 = y;
+	}
+	for(i = y; i < damage_y1; i ++) damage[i * 2] = damage[i * 2 + 1] = 0;
+	for(i = damage_y2; i < y + height; i ++) damage[i * 2] = damage[i * 2 + 1] = 0;
+	if(y < damage_y1) damage_y1 = y;
+	if(y + height > damage_y2) damage_y2 = y + height;
+
+	for(i = y; i < y + height; i ++) {
+		if(damage[i * 2] >= damage[i * 2 + 1]) {
+			damage[i * 2] = x;
+			damage[i * 2 + 1] = x + width;
+		} else {
+			if(x < damage[i * 2]) damage[i * 2] = x;
+			if(x + width > damage[i * 2 + 1]) damage[i * 2 + 1] = x + width;
+		}
+	}
+}
+
 void fb_sync(void) {
+	const int bytes = fb_bpp / 8;
 	char *p, *p2;
-	int i;
+	int i, x1, x2;
 	
-	p = fb_newbuf;
-	p2 = fb_addr;
-	for(i = 0; i < fb_height; i ++) {
-		memcpy(p2, p, fb_xsize);
-		
-		p += fb_xsize;
-		p2 += fb_xoffset;
+	fb_flush();
+
+	if(damage == NULL) {
+		p = fb_newbuf;
+		p2 = fb_addr;
+		for(i = 0; i < fb_height; i ++) {
+			memcpy(p2, p, fb_xsize);
+			
+			p += fb_xsize;
+			p2 += fb_xoffset;
+		}
+		return;
+	}
+
+	for(i = damage_y1; i < damage_y2; i ++) {
+		x1 = damage[i * 2];
+		x2 = damage[i * 2 + 1];
+		if(x1 < x2) memcpy(fb_addr + i * fb_xoffset + x1 * bytes, fb_newbuf + i * fb_xsize + x1 * bytes, (x2 - x1) * bytes);
 	}
+	damage_y1 = damage_y2 = 0;
 }
 
 int fb_save(void) {
@@ -200,28 +328,48 @@ typedef struct {
 	unsigned cwidth;
 	unsigned cheight;
 	unsigned char *pixdata;
-	unsigned char *rundata;
+	unsigned int *rowbits; // one mask per glyph row, bit 0 leftmost: [bold][glyph][row]
+	int decoded;
+	unsigned int glyphs;
+
+	// PSF fonts index their glyphs straight out of the read-only mapping
+	const unsigned char *psf;
+	unsigned int psf_bytes; // per glyph
+	void *map;
+	size_t map_len;
+	int unicode; // glyphs found through unimap, by codepoint otherwise
+	unsigned short *unimap[256]; // BMP codepoint >> 8 -> page of glyph + 1, 0 unmapped
+
+	struct sdf *sdf[2]; // distance fields for fb_text_sdf(), regular and bold
 } font_t;
 
-static void font_rundata(font_t *font) {
-	unsigned char data;
-    unsigned char* in = font->pixdata;
+#define FONT_MAX 16
+#define FONT_MAX_HEIGHT 64
 
-	unsigned char* bits;
-	unsigned int sz;
+#define FONT_ROWS(font,bold,glyph) ((font)->rowbits + ((bold) * 96 + (glyph)) * (font)->cheight)
 
-	if(font->rundata) return;
+static void font_rowbits(font_t *font) {
+	unsigned char data;
+	unsigned char *in = font->pixdata;
+	unsigned int sz, x, y, p = 0;
 
-	sz = font->width * font->height;
-	font->rundata = bits = malloc(sz);
+	if(font->decoded) return;
+	font->decoded = 1;
 
-	dprintf("font_data size is %.3lfKB\n", sz / 1024.0f);
+	dprintf("font_data size is %.3lfKB\n", 96 * font->height * sizeof(unsigned int) / 1024.0f);
 
-    while((data = *in++)) {
-    	sz = data & 0x7f;
-        memset(bits, (data & 0x80) ? 255 : 0, sz);
-        bits += sz;
-    }
+	while((data = *in++)) {
+		sz = data & 0x7f;
+		if(!(data & 0x80)) {
+			p += sz;
+			continue;
+		}
+		for(; sz; sz --, p ++) {
+			x = p % font->width;
+			y = p / font->width;
+			FONT_ROWS(font, y / font->cheight, x / font->cwidth)[y % font->cheight] |= 1u << (x % font->cwidth);
+		}
+	}
 }
 
 #include "font_08x14.h"
@@ -229,375 +377,2433 @@ static void font_rundata(font_t *font) {
 #include "font_12x22.h"
 #include "font_18x32.h"
 static font_t *font = NULL;
-
+static font_t *fonts[FONT_MAX] = {
+	[FONT_08x14] = &font_08x14,
+	[FONT_10x18] = &font_10x18,
+	[FONT_12x22] = &font_12x22,
+	[FONT_18x32] = &font_18x32,
+};
+
+// fonts decode into their static tables on first use
 static void init_font(void) {
-	font_rundata(&font_08x14);
-	font_rundata(&font_10x18);
-	font_rundata(&font_12x22);
-	font_rundata(&font_18x32);
-	
 	font = &font_12x22;
+	font_rowbits(font);
 }
 
 void fb_set_font(font_family_t family) {
-	switch(family) {
-		case FONT_08x14:
-			font = &font_08x14;
-			break;
-		case FONT_10x18:
-			font = &font_10x18;
-			break;
-		case FONT_12x22:
-		default:
-			font = &font_12x22;
-			break;
-		case FONT_18x32:
-			font = &font_18x32;
-			break;
-	}
+	if(family < 0 || family >= FONT_MAX || fonts[family] == NULL) family = FONT_12x22;
+
+	font = fonts[family];
+	if(font->psf == NULL) font_rowbits(font);
 }
 
+static void glyph_cache_free(void);
 static void free_font(void) {
-	if(font_10x18.rundata) {
-		free(font_10x18.rundata);
-		font_10x18.rundata = NULL;
-	}
-	if(font_12x22.rundata) {
-		free(font_12x22.rundata);
-		font_12x22.rundata = NULL;
-	}
-	if(font_18x32.rundata) {
-		free(font_18x32.rundata);
-		font_18x32.rundata = NULL;
-	}
-}
-
-static bool outside(int x, int y) {
-    return x < 0 || x >= fb_width || y < 0 || y >= fb_height;
-}
-
-static void text_blend(unsigned char* src_p, int src_row_bytes, unsigned char* dst_p, int dst_row_bytes, int width, int height, int color, int size) {
-    int i, j;
-    int cx = size, cy = size;
-    for (j = 0; j < height * size; ++j) {
-        unsigned char* sx = src_p;
-        unsigned char* px = dst_p;
-        for (i = 0; i < width * size; ++i) {
-            unsigned char a = *sx;
-            if(--cx <= 0) {
-            	cx = size;
-            	sx ++;
-            }
-            if (a == 255) {
-            	memcpy(px, &color, fb_bpp / 8);
-            } else if (a > 0) {
-            	int color2 = color | (a << 24);
-                memcpy(px, &color2, fb_bpp / 8);
-            }
-			px += fb_bpp / 8;
-        }
-        if(--cy <= 0) {
-        	cy = size;
-        	src_p += src_row_bytes;
-    	}
-        dst_p += dst_row_bytes;
-    }
+	int i, j;
+
+	glyph_cache_free();
+
+	for(i = 0; i < FONT_MAX; i ++) {
+		if(fonts[i] == NULL) continue;
+
+		for(j = 0; j < 2; j ++) {
+			free(fonts[i]->sdf[j]);
+			fonts[i]->sdf[j] = NULL;
+		}
+	}
+
+	for(i = FONT_18x32 + 1; i < FONT_MAX; i ++) {
+		if(fonts[i] == NULL) continue;
+
+		for(j = 0; j < 256; j ++) free(fonts[i]->unimap[j]);
+		munmap(fonts[i]->map, fonts[i]->map_len);
+		free(fonts[i]);
+		fonts[i] = NULL;
+	}
+	font = NULL;
 }
 
-int fb_font_width() {
-	return font->cwidth;
+// codepoint at *s, U+FFFD for malformed input; end bounds the input or is
+// NULL for a NUL-terminated string
+static unsigned int utf8_decode(const unsigned char **s, const unsigned char *end) {
+	const unsigned char *p = *s;
+	unsigned int cp = *p ++, n, i;
+
+	if(cp < 0x80) {
+		n = 0;
+	} else if((cp & 0xe0) == 0xc0) {
+		n = 1;
+		cp &= 0x1f;
+	} else if((cp & 0xf0) == 0xe0) {
+		n = 2;
+		cp &= 0x0f;
+	} else if((cp & 0xf8) == 0xf0) {
+		n = 3;
+		cp &= 0x07;
+	} else {
+		*s = p;
+		return 0xfffd;
+	}
+
+	for(i = 0; i < n; i ++, p ++) {
+		if((end && p >= end) || (*p & 0xc0) != 0x80) {
+			*s = p;
+			return 0xfffd;
+		}
+		cp = cp << 6 | (*p & 0x3f);
+	}
+	*s = p;
+
+	return cp;
 }
 
-int fb_font_height() {
-	return font->cheight;
+// 0 at the end of the string
+static unsigned int utf8_next(const char **s) {
+	if(**s == '\0') return 0;
+
+	return utf8_decode((const unsigned char**) s, NULL);
 }
 
-void fb_text(int x, int y, const char *s, int color, int bold, int size) {
-    unsigned off;
-    
-    bold = bold && (font->height != font->cheight);
+static int utf8_len(const char *s) {
+	int n = 0;
 
-    while((off = *s++)) {
-        off -= 32;
-        if (outside(x, y) || outside(x + font->cwidth * size - 1, y + font->cheight - 1)) break;
-        if (off < 96) {
-            unsigned char* src_p = font->rundata + (off * font->cwidth) + (bold ? font->cheight * font->width : 0);
-            unsigned char* dst_p = (unsigned char*) fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
+	while(utf8_next(&s)) n ++;
 
-            text_blend(src_p, font->width, dst_p, fb_xsize, font->cwidth, font->cheight, color, size);
-        }
-        x += font->cwidth * size;
-    }
+	return n;
 }
 
-#define FB_ASSERT_POINT(x,y) assert((x >= 0 && x < fb_width) && (y >= 0 && y < fb_height)) 
-#define FB_ASSERT_RECT(x,y,w,h) assert((x >= 0 && y >= 0) && (w > 0 && h > 0) && (x + w <= fb_width && y + h <= fb_height))
+static void font_unimap(font_t *f, unsigned int cp, unsigned int glyph) {
+	unsigned short **page = &f->unimap[cp >> 8];
 
-void fb_fill_rect(int x, int y, int width, int height, unsigned int color) {
-	char *p, *p2;
+	if(cp > 0xffff || glyph >= f->glyphs) return;
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, width, height);
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < height; y ++) {
-		p = p2;
-		for(x = 0; x < width; x ++) {
-			memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	if(*page == NULL) {
+		*page = (unsigned short*) calloc(256, sizeof(unsigned short));
+		if(*page == NULL) {
+			pprintf("calloc font unimap failed");
+			return;
 		}
-		p2 += fb_xsize;
 	}
+	if((*page)[cp & 0xff] == 0) (*page)[cp & 0xff] = glyph + 1;
+	f->unicode = 1;
 }
 
-void fb_draw_rect(int x, int y, int width, int height, unsigned int color, int weight) {
-	char *p, *p2;
+// PSF1/PSF2 console fonts, glyphs up to 32 pixels wide
+int fb_load_font(const char *path) {
+	const unsigned char *p, *end;
+	struct stat st;
+	font_t *f;
+	unsigned int i, hdr, flags = 0;
+	int fd, family, psf1;
+
+	for(family = FONT_18x32 + 1; family < FONT_MAX && fonts[family]; family ++);
+	if(family == FONT_MAX) {
+		eprintf("too many fonts\n");
+		return FB_ERR;
+	}
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, width, height);
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < height; y ++) {
-		p = p2;
-		for(x = 0; x < width; x ++) {
-			if(y < weight || y >= height - weight || x < weight || x >= width - weight) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	f = (font_t*) calloc(1, sizeof(font_t));
+	if(f == NULL) {
+		pprintf("calloc font failed");
+		return FB_ERR;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		pprintf("open font");
+		free(f);
+		return FB_ERR;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < 32) {
+		eprintf("%s: not a PSF font\n", path);
+		close(fd);
+		free(f);
+		return FB_ERR;
+	}
+	f->map_len = st.st_size;
+	f->map = mmap(NULL, f->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(f->map == MAP_FAILED) {
+		pprintf("mmap font");
+		free(f);
+		return FB_ERR;
+	}
+
+	p = (const unsigned char*) f->map;
+	end = p + f->map_len;
+
+	#define LE32(q) ((q)[0] | (q)[1] << 8 | (q)[2] << 16 | (unsigned int) (q)[3] << 24)
+	psf1 = p[0] == 0x36 && p[1] == 0x04;
+	if(psf1) {
+		f->glyphs = (p[2] & 0x01) ? 512 : 256;
+		flags = p[2] & 0x06; // has unicode table, with sequences
+		f->cwidth = 8;
+		f->cheight = f->psf_bytes = p[3];
+		hdr = 4;
+	} else if(LE32(p) == 0x864ab572) { // PSF2
+		hdr = max(LE32(p + 8), 32);
+		flags = LE32(p + 12) & 0x01;
+		f->glyphs = LE32(p + 16);
+		f->psf_bytes = LE32(p + 20);
+		f->cheight = LE32(p + 24);
+		f->cwidth = LE32(p + 28);
+	} else {
+		hdr = 0;
+	}
+	#undef LE32
+
+	if(hdr == 0 || f->cwidth == 0 || f->cwidth > 32 || f->cheight == 0 || f->cheight > FONT_MAX_HEIGHT ||
+			f->psf_bytes < (f->cwidth + 7) / 8 * f->cheight || hdr > f->map_len ||
+			f->glyphs > (f->map_len - hdr) / f->psf_bytes) {
+		eprintf("%s: not a usable PSF font\n", path);
+		munmap(f->map, f->map_len);
+		free(f);
+		return FB_ERR;
+	}
+	f->psf = p + hdr;
+	f->width = f->cwidth * f->glyphs;
+	f->height = f->cheight;
+
+	// unicode table: per glyph a list of codepoints, combining sequences after a
+	// separator are skipped, a terminator ends the glyph
+	p = f->psf + f->glyphs * f->psf_bytes;
+	for(i = 0; flags && i < f->glyphs && p < end; i ++) {
+		unsigned int cp;
+		int seq = 0;
+
+		if(psf1) { // UCS-2 little endian
+			for(; p + 1 < end; p += 2) {
+				cp = p[0] | p[1] << 8;
+				if(cp == 0xffff) break;
+				if(cp == 0xfffe) seq = 1;
+				else if(!seq) font_unimap(f, cp, i);
+			}
+			p += 2;
+		} else { // UTF-8
+			while(p < end && *p != 0xff) {
+				if(*p == 0xfe) {
+					seq = 1;
+					p ++;
+					continue;
+				}
+
+				cp = utf8_decode(&p, end);
+				if(!seq) font_unimap(f, cp, i);
+			}
+			p ++;
 		}
-		p2 += fb_xsize;
 	}
+
+	fonts[family] = f;
+	dprintf("%s: %u glyphs %ux%u\n", path, f->glyphs, f->cwidth, f->cheight);
+
+	return family;
 }
 
-void fb_fill_round_rect(int x, int y, int width, int height, unsigned int color, int corner) {
-	int i, r;
-	char *p, *p2;
+// built-in fonts carry a bold half, PSF fonts get it synthesized
+static int font_bold(const font_t *f, int bold) {
+	return bold && (f->psf || f->height != f->cheight);
+}
 
-	struct {
-		int x;
-		int y;
-		int x0;
-		int y0;
-	} points[] = {
-		{x, y, corner - 1, corner - 1}, // left top
-		{x, y + height - corner, corner - 1, 0}, // left bottom
-		{x + width - corner, y, 0, corner - 1}, // right top
-		{x + width - corner, y + height - corner, 0, 0} // right bottom
-	};
+// glyph of a codepoint, -1 for none
+static int font_index(const font_t *f, unsigned int cp) {
+	const unsigned short *page;
 
-	fb_fill_rect(x + corner, y, width - corner * 2, corner, color); // top
-	fb_fill_rect(x, y + corner, width, height - corner * 2, color); // center
-	fb_fill_rect(x + corner, y + height - corner, width - corner * 2, corner, color); // bottom
+	if(f->psf == NULL) return (cp >= 32 && cp < 128) ? (int) cp - 32 : -1;
 
-	for(i = 0; i < sizeof(points)/sizeof(points[0]); i ++) {
-		p2 = fb_newbuf + points[i].y * fb_xsize + points[i].x * fb_bpp / 8;
-		for(y = 0; y < corner; y ++) {
-			p = p2;
-			for(x = 0; x < corner; x ++) {
-				r = sqrt(pow(x - points[i].x0, 2) + pow(y - points[i].y0, 2));
-				if(r < corner) memcpy(p, &color, fb_bpp / 8);
-				p += fb_bpp / 8;
-			}
-			p2 += fb_xsize;
+	if(!f->unicode) return cp < f->glyphs ? (int) cp : -1;
+
+	if(cp > 0xffff || (page = f->unimap[cp >> 8]) == NULL) return -1;
+
+	return page[cp & 0xff] - 1;
+}
+
+// row masks of a glyph, bit 0 leftmost; PSF rows are MSB first and get
+// converted from the mapping into buf, FONT_MAX_HEIGHT entries
+static const unsigned int *font_glyph(const font_t *f, int bold, unsigned int glyph, unsigned int *buf) {
+	const unsigned char *src;
+	unsigned int r, i, m, b, mask;
+
+	if(f->psf == NULL) return FONT_ROWS(f, bold, glyph);
+
+	mask = f->cwidth == 32 ? ~0u : (1u << f->cwidth) - 1;
+	src = f->psf + glyph * f->psf_bytes;
+	for(r = 0; r < f->cheight; r ++) {
+		for(i = m = 0; i < (f->cwidth + 7) / 8; i ++) {
+			b = *src ++;
+			b = (b * 0x0202020202ull & 0x010884422010ull) % 1023; // reverse the byte
+			m |= b << (i * 8);
 		}
+		if(bold) m |= m << 1;
+		buf[r] = m & mask;
 	}
+
+	return buf;
 }
 
-void fb_draw_round_rect(int x, int y, int width, int height, unsigned int color, int weight, int corner) {
-	int i, r;
-	char *p, *p2;
+int fb_font_width() {
+	return font->cwidth;
+}
 
-	struct {
-		int x;
-		int y;
-		int x0;
-		int y0;
-	} points[] = {
-		{x, y, corner - 1, corner - 1}, // left top
-		{x, y + height - corner, corner - 1, 0}, // left bottom
-		{x + width - corner, y, 0, corner - 1}, // right top
-		{x + width - corner, y + height - corner, 0, 0} // right bottom
-	};
+int fb_font_height() {
+	return font->cheight;
+}
 
-	fb_fill_rect(x + corner, y, width - corner * 2, weight, color); // top
-	fb_fill_rect(x, y + corner, weight, height - corner * 2, color); // left
-	fb_fill_rect(x + corner, y + height - weight, width - corner * 2, weight, color); // bottom
-	fb_fill_rect(x + width - weight, y + corner, weight, height - corner * 2, color); // right
+// Rasterizers draw into a canvas and never touch pixels outside its clip
+// rectangle; the per-pixel tests only use absolute coordinates, so a
+// primitive split over several clips gives the same pixels as one pass.
+typedef struct {
+	char *buf; // pixel (0, 0)
+	int pitch;
+	int width, height;
+	int x1, y1, x2, y2; // clip, x2 and y2 exclusive
+} canvas_t;
 
-	for(i = 0; i < sizeof(points)/sizeof(points[0]); i ++) {
-		p2 = fb_newbuf + points[i].y * fb_xsize + points[i].x * fb_bpp / 8;
-		for(y = 0; y < corner; y ++) {
-			p = p2;
-			for(x = 0; x < corner; x ++) {
-				r = sqrt(pow(x - points[i].x0, 2) + pow(y - points[i].y0, 2));
-				if(r < corner && r >= corner - weight) memcpy(p, &color, fb_bpp / 8);
+static canvas_t fb_canvas;
+static canvas_t *fb_target = &fb_canvas; // drawing calls go here
+
+static bool outside(const canvas_t *cv, int x, int y) {
+    return x < 0 || x >= cv->width || y < 0 || y >= cv->height;
+}
+
+static void init_canvas(void) {
+	fb_canvas.buf = fb_newbuf;
+	fb_canvas.pitch = fb_xsize;
+	fb_canvas.width = fb_width;
+	fb_canvas.height = fb_height;
+	fb_canvas.x1 = fb_canvas.y1 = 0;
+	fb_canvas.x2 = fb_width;
+	fb_canvas.y2 = fb_height;
+}
+
+static inline bool clip_box(const canvas_t *cv, int *x1, int *y1, int *x2, int *y2) {
+	if(*x1 < cv->x1) *x1 = cv->x1;
+	if(*y1 < cv->y1) *y1 = cv->y1;
+	if(*x2 > cv->x2) *x2 = cv->x2;
+	if(*y2 > cv->y2) *y2 = cv->y2;
+
+	return *x1 < *x2 && *y1 < *y2;
+}
+
+#define PIXEL(cv,x,y) ((cv)->buf + (y) * (cv)->pitch + (x) * fb_bpp / 8)
+
+// n pixels of one color, word stores the compiler can vectorize
+static void fill_span(char *p, unsigned int color, int n) {
+	int i;
+
+	switch(fb_bpp) {
+		case 32: {
+			unsigned int *p32 = (unsigned int*) p;
+			for(i = 0; i < n; i ++) p32[i] = color;
+			break;
+		}
+		case 16: {
+			unsigned short *p16 = (unsigned short*) p;
+			for(i = 0; i < n; i ++) p16[i] = color;
+			break;
+		}
+		default:
+			for(i = 0; i < n; i ++) {
+				memcpy(p, &color, fb_bpp / 8);
 				p += fb_bpp / 8;
 			}
-			p2 += fb_xsize;
-		}
+			break;
 	}
 }
 
-void fb_draw_line(int x1, int y1, int x2, int y2, unsigned int color, int weight) {
-	int x, y;
-	char *p, *p2;
-	int cx, cy;
-	int minX, maxX;
-	int minY, maxY;
-	double x0, y0, radius, cR, cY;
-
-	FB_ASSERT_POINT(x1, y1);
-	FB_ASSERT_POINT(x2, y2);
-	
-	x0 = (x1 + x2) / 2.0f;
-	y0 = (y1 + y2) / 2.0f;
-	
-	cx = x1 - x2;
-	cy = y1 - y2;
-	
-	cR = sqrt((double)(cy*cy+cx*cx));
-	
-	radius = sqrt(pow(x1 - x0, 2) + pow(y1 - y0, 2)) + weight;
-	
-	minX = min(x1, x2) - weight * 2;
-	maxX = max(x1, x2) + weight * 2;
-	minY = min(y1, y2) - weight * 2;
-	maxY = max(y1, y2) + weight * 2;
-	if(minX < 0) minX = 0;
-	if(minY < 0) minY = 0;
-	if(maxX >= fb_width) maxX = fb_width - 1;
-	if(maxY >= fb_height) maxY = fb_height - 1;
-
-	p2 = fb_newbuf + minY * fb_xsize + minX * fb_bpp / 8;
-	for(y = minY; y <= maxY; y ++) {
-		p = p2;
-		cY = pow(y - y0, 2);
-		for(x = minX; x <= maxX; x ++) {
-			if(sqrt(pow(x - x0, 2) + cY) < radius && (cx || cy) && abs(x*cy-y*cx-x1*cy+y1*cx)/cR <= weight / 2.0f) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+typedef unsigned int v4u32 __attribute__((vector_size(16)));
+typedef unsigned short v8u16 __attribute__((vector_size(16)));
+
+// store color where bit i of m is set, for pixels 0..n-1 from p
+static void mask_span(char *p, unsigned int m, int n, unsigned int color) {
+	switch(fb_bpp) {
+		case 32: {
+			const v4u32 bit = {1, 2, 4, 8};
+			v4u32 d, sel;
+
+			for(; n >= 4; n -= 4, m >>= 4, p += sizeof(d)) {
+				if(!(m & 0xf)) continue;
+				sel = (v4u32) ((m & bit) != 0);
+				memcpy(&d, p, sizeof(d));
+				d = (d & ~sel) | (color & sel);
+				memcpy(p, &d, sizeof(d));
+			}
+			break;
 		}
-		p2 += fb_xsize;
+		case 16: {
+			const v8u16 bit = {1, 2, 4, 8, 16, 32, 64, 128};
+			v8u16 d, sel;
+
+			for(; n >= 8; n -= 8, m >>= 8, p += sizeof(d)) {
+				if(!(m & 0xff)) continue;
+				sel = (v8u16) (((unsigned short) m & bit) != 0);
+				memcpy(&d, p, sizeof(d));
+				d = (d & ~sel) | ((unsigned short) color & sel);
+				memcpy(p, &d, sizeof(d));
+			}
+			break;
+		}
+	}
+
+	for(; n > 0 && m; n --, m >>= 1, p += fb_bpp / 8) {
+		if(m & 1) memcpy(p, &color, fb_bpp / 8);
 	}
 }
 
-void fb_fill_oval(int x, int y, int width, int height, unsigned int color) {
-	char *p, *p2;
-	double a, b;
-	double fx1,fx2,fy1,fy2;
-	double f;
+static void text_blend(const canvas_t *cv, const unsigned int *rows, int x, int y, int width, int height, int color, int size) {
+	int i, j;
+	int x1 = x, y1 = y, x2 = x + width * size, y2 = y + height * size;
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, width, height);
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
 
-	a = width / 2.0f;
-	b = height / 2.0f;
-	if(a > b) {
-		f = sqrt(a * a - b * b);
-		fx1 = a - f;
-		fx2 = a + f;
-		fy1 = fy2 = b;
-		f = 2.0f * a;
-	} else {
-		f = sqrt(b * b - a * a);
-		fx1 = fx2 = a;
-		fy1 = b - f;
-		fy2 = b + f;
-		f = 2.0f * b;
-	}
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < height; y ++) {
-		p = p2;
-		for(x = 0; x < width; x ++) {
-			a = sqrt(pow(x - fx1, 2) + pow(y - fy1, 2)) + sqrt(pow(x - fx2, 2) + pow(y - fy2, 2));
-			if(a <= f) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	for(j = y1; j < y2; j ++) {
+		unsigned int m = rows[(j - y) / size];
+		char *px = PIXEL(cv, x1, j);
+
+		if(size == 1) {
+			mask_span(px, m >> (x1 - x), x2 - x1, color);
+			continue;
+		}
+		for(i = x1; i < x2; i ++, px += fb_bpp / 8) {
+			if(m >> ((i - x) / size) & 1) memcpy(px, &color, fb_bpp / 8);
 		}
-		p2 += fb_xsize;
 	}
 }
 
-void fb_draw_oval(int x, int y, int width, int height, unsigned int color, int weight) {
-	char *p, *p2;
-	double a, b;
-	double fx1,fx2,fy1,fy2;
-	double f;
+// Glyphs of one (font, bold, size) already scaled, as horizontal runs per
+// source row; a scaled glyph is then size rows of span fills per run.
+typedef struct {
+	unsigned short x, w; // scaled pixels
+} glyph_run_t;
+
+typedef struct glyph_cache {
+	struct glyph_cache *next; // most recently used first
+	font_t *font;
+	int bold;
+	int size;
+	unsigned int gen; // last fb_flush() generation drawing with it
+	size_t bytes;
+	unsigned int *rows; // glyphs * cheight + 1 offsets into runs
+	glyph_run_t *runs;
+} glyph_cache_t;
+
+static glyph_cache_t *glyph_cache = NULL;
+static size_t glyph_cache_bytes = 0, glyph_cache_max = 256 * 1024;
+static unsigned long glyph_cache_hits = 0, glyph_cache_misses = 0;
+static unsigned int flush_gen = 0;
+
+static glyph_cache_t *glyph_cache_new(font_t *font, int bold, int size) {
+	glyph_cache_t *gc;
+	unsigned int buf[FONT_MAX_HEIGHT];
+	const unsigned int *rows;
+	unsigned int m, glyph, r, i, n = 0, start;
+	size_t bytes;
+
+	for(glyph = 0; glyph < font->glyphs; glyph ++) {
+		rows = font_glyph(font, bold, glyph, buf);
+		for(r = 0; r < font->cheight; r ++) {
+			m = rows[r];
+			n += __builtin_popcount(m & ~(m << 1)); // run starts
+		}
+	}
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, width, height);
+	bytes = sizeof(glyph_cache_t) + (font->glyphs * font->cheight + 1) * sizeof(unsigned int) + n * sizeof(glyph_run_t);
+	if(bytes > glyph_cache_max) return NULL;
 
-	a = width / 2.0f;
-	b = height / 2.0f;
-	if(a > b) {
-		f = sqrt(a * a - b * b);
-		fx1 = a - f;
-		fx2 = a + f;
-		fy1 = fy2 = b;
-		f = 2.0f * a;
-	} else {
-		f = sqrt(b * b - a * a);
-		fx1 = fx2 = a;
-		fy1 = b - f;
-		fy2 = b + f;
-		f = 2.0f * b;
+	gc = (glyph_cache_t*) malloc(bytes);
+	if(gc == NULL) {
+		pprintf("malloc glyph cache failed");
+		return NULL;
 	}
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < height; y ++) {
-		p = p2;
-		for(x = 0; x < width; x ++) {
-			a = sqrt(pow(x - fx1, 2) + pow(y - fy1, 2)) + sqrt(pow(x - fx2, 2) + pow(y - fy2, 2)) - f;
-			if(a <= 0 && a >= -weight*2.0f) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	gc->font = font;
+	gc->bold = bold;
+	gc->size = size;
+	gc->bytes = bytes;
+	gc->rows = (unsigned int*) (gc + 1);
+	gc->runs = (glyph_run_t*) (gc->rows + font->glyphs * font->cheight + 1);
+
+	for(glyph = n = 0; glyph < font->glyphs; glyph ++) {
+		rows = font_glyph(font, bold, glyph, buf);
+		for(r = 0; r < font->cheight; r ++) {
+			m = rows[r];
+			gc->rows[glyph * font->cheight + r] = n;
+			for(i = 0; i < font->cwidth; ) {
+				if(!(m >> i & 1)) {
+					i ++;
+					continue;
+				}
+				for(start = i; i < font->cwidth && (m >> i & 1); i ++);
+				gc->runs[n].x = start * size;
+				gc->runs[n].w = (i - start) * size;
+				n ++;
+			}
 		}
-		p2 += fb_xsize;
 	}
-}
+	gc->rows[font->glyphs * font->cheight] = n;
 
-void fb_fill_circle(int x, int y, int radius, unsigned int color) {
-	char *p, *p2;
-	int side = radius * 2;
+	return gc;
+}
 
-	x -= radius;
-	y -= radius;
+// least recently used first, never what pending draw commands still use
+static void glyph_cache_evict(size_t need) {
+	glyph_cache_t **pp, **victim;
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, side, side);
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < side; y ++) {
-		p = p2;
-		for(x = 0; x < side; x ++) {
-			if(sqrt(pow(x - radius, 2) + pow(y - radius, 2)) <= radius) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	while(glyph_cache_bytes + need > glyph_cache_max) {
+		victim = NULL;
+		for(pp = &glyph_cache; *pp; pp = &(*pp)->next) {
+			if((*pp)->gen != flush_gen) victim = pp;
 		}
-		p2 += fb_xsize;
+		if(victim == NULL) break;
+
+		glyph_cache_t *gc = *victim;
+		*victim = gc->next;
+		glyph_cache_bytes -= gc->bytes;
+		free(gc);
 	}
 }
 
-void fb_draw_circle(int x, int y, int radius, unsigned int color, int weight) {
-	char *p, *p2;
-	int side = radius * 2;
-	int r;
+static glyph_cache_t *glyph_cache_get(font_t *font, int bold, int size) {
+	glyph_cache_t **pp, *gc;
 
-	x -= radius;
-	y -= radius;
+	bold = font_bold(font, bold);
 
-	FB_ASSERT;
-	FB_ASSERT_RECT(x, y, side, side);
-	
-	p2 = fb_newbuf + y * fb_xsize + x * fb_bpp / 8;
-	for(y = 0; y < side; y ++) {
-		p = p2;
-		for(x = 0; x < side; x ++) {
-			r = sqrt(pow(x - radius, 2) + pow(y - radius, 2));
-			if(r < radius && r >= radius - weight) memcpy(p, &color, fb_bpp / 8);
-			p += fb_bpp / 8;
+	for(pp = &glyph_cache; (gc = *pp); pp = &gc->next) {
+		if(gc->font == font && gc->bold == bold && gc->size == size) {
+			*pp = gc->next;
+			break;
 		}
-		p2 += fb_xsize;
 	}
+
+	if(gc) {
+		glyph_cache_hits ++;
+	} else {
+		glyph_cache_misses ++;
+
+		gc = glyph_cache_new(font, bold, size);
+		if(gc == NULL) return NULL;
+
+		glyph_cache_evict(gc->bytes);
+		glyph_cache_bytes += gc->bytes;
+	}
+
+	gc->gen = flush_gen;
+	gc->next = glyph_cache;
+	glyph_cache = gc;
+
+	return gc;
+}
+
+static void glyph_cache_free(void) {
+	glyph_cache_t *gc;
+
+	while((gc = glyph_cache)) {
+		glyph_cache = gc->next;
+		free(gc);
+	}
+	glyph_cache_bytes = 0;
+}
+
+void fb_glyph_cache_limit(size_t bytes) {
+	glyph_cache_max = bytes;
+	glyph_cache_evict(0);
+}
+
+void fb_glyph_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes) {
+	if(hits) *hits = glyph_cache_hits;
+	if(misses) *misses = glyph_cache_misses;
+	if(bytes) *bytes = glyph_cache_bytes;
+}
+
+static void glyph_blit(const canvas_t *cv, const glyph_cache_t *gc, unsigned int glyph, int x, int y, int color) {
+	const unsigned int *rows = gc->rows + glyph * gc->font->cheight;
+	unsigned int r, i;
+	int j, x1, y1, x2, y2;
+
+	for(r = 0; r < gc->font->cheight; r ++) {
+		for(i = rows[r]; i < rows[r + 1]; i ++) {
+			x1 = x + gc->runs[i].x;
+			x2 = x1 + gc->runs[i].w;
+			y1 = y + r * gc->size;
+			y2 = y1 + gc->size;
+			if(!clip_box(cv, &x1, &y1, &x2, &y2)) continue;
+
+			for(j = y1; j < y2; j ++) fill_span(PIXEL(cv, x1, j), color, x2 - x1);
+		}
+	}
+}
+
+static void raster_text(const canvas_t *cv, font_t *font, const glyph_cache_t *gc, int x, int y, const char *s, int color, int bold, int size) {
+    unsigned int cp, buf[FONT_MAX_HEIGHT];
+    int glyph;
+    
+    bold = font_bold(font, bold);
+
+    while((cp = utf8_next(&s))) {
+        if (outside(cv, x, y) || outside(cv, x + font->cwidth * size - 1, y + font->cheight - 1)) break;
+        if ((glyph = font_index(font, cp)) >= 0) {
+            if(gc) glyph_blit(cv, gc, glyph, x, y, color);
+            else text_blend(cv, font_glyph(font, bold, glyph, buf), x, y, font->cwidth, font->cheight, color, size);
+        }
+        x += font->cwidth * size;
+    }
+}
+
+typedef unsigned long long bits_t;
+
+static void bits_set(bits_t *row, int from, int n) {
+	int k;
+
+	for(; n > 0; n -= k, from += k) {
+		k = min(n, 64 - (from & 63));
+		row[from >> 6] |= (k == 64 ? ~0ull : (1ull << k) - 1) << (from & 63);
+	}
+}
+
+// 64 bits from bit off on, zero outside the nw words of row
+static bits_t bits_at(const bits_t *row, int nw, int off) {
+	int w = off >> 6, s = off & 63;
+	bits_t lo, hi;
+
+	if(row == NULL) return 0;
+
+	lo = (w >= 0 && w < nw) ? row[w] : 0;
+	hi = (w + 1 >= 0 && w + 1 < nw) ? row[w + 1] : 0;
+
+	return s ? (lo >> s | hi << (64 - s)) : lo;
+}
+
+static void text_fx_margins(const fb_text_fx_t *fx, int *left, int *top, int *right, int *bottom) {
+	*left = *top = *right = *bottom = (fx->effects & (FB_TEXT_OUTLINE | FB_TEXT_BEVEL)) ? 1 : 0;
+	if(fx->effects & FB_TEXT_SHADOW) {
+		*left = max(*left, -fx->shadow_dx);
+		*right = max(*right, fx->shadow_dx);
+		*top = max(*top, -fx->shadow_dy);
+		*bottom = max(*bottom, fx->shadow_dy);
+	}
+}
+
+// The string's coverage is built once as row bitsets and every effect is a
+// shifted view of it, layered face, lowlight, highlight, outline, shadow
+// from top to bottom; a layer only keeps the bits no layer above it took,
+// so each destination pixel is written once.
+static void raster_text_fx(const canvas_t *cv, font_t *font, int x, int y, const char *s, int color, int bold, int size, const fb_text_fx_t *fx) {
+	unsigned int cp, buf[FONT_MAX_HEIGHT], m;
+	const unsigned int *rows;
+	bits_t *face, b, l, done;
+	const bits_t *up, *mid, *down, *sh;
+	int i, j, k, r, n, nw, off, px, glyph;
+	int width, height, left, top, right, bottom;
+	int x1, y1, x2, y2;
+	char *p;
+
+	bold = font_bold(font, bold);
+	width = utf8_len(s) * font->cwidth * size;
+	height = font->cheight * size;
+	if(width == 0) return;
+
+	text_fx_margins(fx, &left, &top, &right, &bottom);
+	x1 = x - left;
+	y1 = y - top;
+	x2 = x + width + right;
+	y2 = y + height + bottom;
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	nw = (width + 63) / 64;
+	face = (bits_t*) calloc(font->cheight * nw, sizeof(bits_t));
+	if(face == NULL) {
+		pprintf("calloc text rows failed");
+		return;
+	}
+
+	for(k = 0; (cp = utf8_next(&s)); k ++) {
+		if((glyph = font_index(font, cp)) < 0) continue;
+
+		rows = font_glyph(font, bold, glyph, buf);
+		for(r = 0; r < font->cheight; r ++) {
+			for(m = rows[r]; m; m &= m + (1u << i)) { // runs of set bits
+				i = __builtin_ctz(m);
+				n = (~m >> i) ? __builtin_ctz(~m >> i) : 32 - i;
+				bits_set(face + r * nw, (k * font->cwidth + i) * size, n * size);
+			}
+		}
+	}
+
+	#define FACE(row) ((row) >= 0 && (row) < height ? face + (row) / size * nw : NULL)
+	#define LAYER(mask,c) do { \
+		for(l = (mask) & ~done, done |= l; l; l &= l + (1ull << i)) { \
+			i = __builtin_ctzll(l); \
+			n = (~l >> i) ? __builtin_ctzll(~l >> i) : 64 - i; \
+			fill_span(p + i * (fb_bpp / 8), c, n); \
+		} \
+	} while(0)
+	for(j = y1; j < y2; j ++) {
+		up = FACE(j - y - 1);
+		mid = FACE(j - y);
+		down = FACE(j - y + 1);
+		sh = (fx->effects & FB_TEXT_SHADOW) ? FACE(j - y - fx->shadow_dy) : NULL;
+		if(!up && !mid && !down && !sh) continue;
+
+		for(px = x1; px < x2; px += 64) {
+			p = PIXEL(cv, px, j);
+			off = px - x;
+			done = x2 - px >= 64 ? 0 : ~0ull << (x2 - px); // clipped bits count as taken
+
+			LAYER(bits_at(mid, nw, off), color);
+			if(fx->effects & FB_TEXT_BEVEL) {
+				LAYER(bits_at(up, nw, off - 1), fx->lowlight);
+				LAYER(bits_at(down, nw, off + 1), fx->highlight);
+			}
+			if(fx->effects & FB_TEXT_OUTLINE) {
+				b = 0;
+				for(r = -1; r <= 1; r ++) {
+					b |= bits_at(up, nw, off + r) | bits_at(mid, nw, off + r) | bits_at(down, nw, off + r);
+				}
+				LAYER(b, fx->outline);
+			}
+			if(sh) LAYER(bits_at(sh, nw, off - fx->shadow_dx), fx->shadow);
+		}
+	}
+	#undef LAYER
+	#undef FACE
+
+	free(face);
+}
+
+// dst + (src - dst) * a / 256 per channel, a in 0..256
+static unsigned int blend_pixel(unsigned int d, unsigned int s, int a) {
+	const struct fb_bitfield *f[] = {&fb_vinfo.red, &fb_vinfo.green, &fb_vinfo.blue, &fb_vinfo.transp};
+	unsigned int r = 0, m;
+	int i, cd, cs;
+
+	for(i = 0; i < 4; i ++) {
+		m = (1u << f[i]->length) - 1;
+		cd = d >> f[i]->offset & m;
+		cs = s >> f[i]->offset & m;
+		r |= (unsigned int) (cd + ((cs - cd) * a >> 8)) << f[i]->offset;
+	}
+	return r;
+}
+
+// color over n pixels from p with coverage alpha[i] in 0..256; 8-bit
+// channels blend two at a time in each 32-bit lane, 565 spreads its
+// channels apart in one word
+static void blend_span(char *p, const unsigned short *alpha, int n, unsigned int color) {
+	unsigned int d, s, a;
+	int i = 0;
+
+	if(fb_bpp == 32 && fb_vinfo.red.length == 8 && fb_vinfo.green.length == 8 && fb_vinfo.blue.length == 8) {
+		const v4u32 rb = (v4u32) {0} + (color & 0xff00ff), g = (v4u32) {0} + (color >> 8 & 0xff00ff);
+		unsigned long long q;
+		v4u32 dv, av;
+
+		for(; i + 4 <= n; i += 4) {
+			memcpy(&q, alpha + i, sizeof(q));
+			if(!q) continue;
+
+			av = (v4u32) {alpha[i], alpha[i + 1], alpha[i + 2], alpha[i + 3]};
+			memcpy(&dv, p + i * 4, sizeof(dv));
+			dv = ((rb * av + (dv & 0xff00ff) * (256 - av)) >> 8 & 0xff00ff)
+				| ((g * av + (dv >> 8 & 0xff00ff) * (256 - av)) & 0xff00ff00);
+			memcpy(p + i * 4, &dv, sizeof(dv));
+		}
+		for(; i < n; i ++) {
+			if(!(a = alpha[i])) continue;
+			memcpy(&d, p + i * 4, 4);
+			d = (((color & 0xff00ff) * a + (d & 0xff00ff) * (256 - a)) >> 8 & 0xff00ff)
+				| (((color >> 8 & 0xff00ff) * a + (d >> 8 & 0xff00ff) * (256 - a)) & 0xff00ff00);
+			memcpy(p + i * 4, &d, 4);
+		}
+		return;
+	}
+
+	if(fb_bpp == 16 && fb_vinfo.red.offset == 11 && fb_vinfo.green.offset == 5 && fb_vinfo.green.length == 6 && fb_vinfo.blue.offset == 0) {
+		unsigned short w;
+
+		s = (color & 0xffff) * 0x10001u & 0x07e0f81f; // unsigned, the halves above bit 15
+		for(; i < n; i ++) {
+			if(!(a = alpha[i] >> 3)) continue;
+			memcpy(&w, p + i * 2, 2);
+			d = w * 0x10001u & 0x07e0f81f;
+			d = (s * a + d * (32 - a)) >> 5 & 0x07e0f81f;
+			w = d | d >> 16;
+			memcpy(p + i * 2, &w, 2);
+		}
+		return;
+	}
+
+	for(d = 0; i < n; i ++, p += fb_bpp / 8) {
+		if(!alpha[i]) continue;
+		memcpy(&d, p, fb_bpp / 8);
+		d = blend_pixel(d, color, alpha[i]);
+		memcpy(p, &d, fb_bpp / 8);
+	}
+}
+
+// Signed distance fields rebuilt from the bitmap glyphs, one byte per source
+// pixel centre: 128 on the outline, SDF_ONE per pixel of distance, inside
+// above. Bilinear samples of it give a smooth outline at any scale.
+#define SDF_PAD 2 // field around the glyph cell, in source pixels
+#define SDF_ONE 32
+#define SDF_REACH 3 // search radius, further distances saturate
+
+typedef struct sdf {
+	int w, h; // per glyph, cell plus padding
+	unsigned char *ready; // per glyph
+	unsigned char *data;
+} sdf_t;
+
+static int glyph_pixel(const font_t *f, const unsigned int *rows, int x, int y) {
+	return x >= 0 && y >= 0 && x < (int) f->cwidth && y < (int) f->cheight && (rows[y] >> x & 1);
+}
+
+static void sdf_glyph(const font_t *f, sdf_t *sdf, int bold, int glyph) {
+	unsigned int buf[FONT_MAX_HEIGHT];
+	const unsigned int *rows = font_glyph(f, bold, glyph, buf);
+	unsigned char *out = sdf->data + (size_t) glyph * sdf->w * sdf->h;
+	int i, j, dx, dy, ex, ey, in, best, v;
+
+	for(j = 0; j < sdf->h; j ++) {
+		for(i = 0; i < sdf->w; i ++) {
+			in = glyph_pixel(f, rows, i - SDF_PAD, j - SDF_PAD);
+
+			// squared distance in half pixels from this centre to the
+			// nearest pixel square of the other side
+			best = (2 * SDF_REACH + 1) * (2 * SDF_REACH + 1);
+			for(dy = -SDF_REACH; dy <= SDF_REACH; dy ++) {
+				for(dx = -SDF_REACH; dx <= SDF_REACH; dx ++) {
+					if(glyph_pixel(f, rows, i - SDF_PAD + dx, j - SDF_PAD + dy) == in) continue;
+
+					ex = max(2 * abs(dx) - 1, 0);
+					ey = max(2 * abs(dy) - 1, 0);
+					best = min(best, ex * ex + ey * ey);
+				}
+			}
+			v = sqrt(best) * SDF_ONE / 2 + 0.5;
+			v = in ? 128 + v : 128 - v;
+			*out ++ = max(0, min(255, v));
+		}
+	}
+}
+
+// the field of (f, bold) with every glyph of s generated; runs at record
+// time so the workers only ever read it
+static sdf_t *sdf_prepare(font_t *f, int bold, const char *s) {
+	sdf_t *sdf = f->sdf[bold];
+	unsigned int cp;
+	int glyph, w, h;
+
+	if(sdf == NULL) {
+		w = f->cwidth + 2 * SDF_PAD;
+		h = f->cheight + 2 * SDF_PAD;
+		sdf = (sdf_t*) malloc(sizeof(sdf_t) + f->glyphs + (size_t) f->glyphs * w * h);
+		if(sdf == NULL) {
+			pprintf("malloc sdf failed");
+			return NULL;
+		}
+		sdf->w = w;
+		sdf->h = h;
+		sdf->ready = (unsigned char*) (sdf + 1);
+		sdf->data = sdf->ready + f->glyphs;
+		memset(sdf->ready, 0, f->glyphs);
+		f->sdf[bold] = sdf;
+
+		dprintf("sdf size is %.3lfKB\n", (f->glyphs + f->glyphs * w * h) / 1024.0f);
+	}
+
+	while((cp = utf8_next(&s))) {
+		if((glyph = font_index(f, cp)) < 0 || sdf->ready[glyph]) continue;
+
+		sdf_glyph(f, sdf, bold, glyph);
+		sdf->ready[glyph] = 1;
+	}
+	return sdf;
+}
+
+// Each destination column maps to a field column once and each destination
+// row interpolates the field rows of the visible glyphs once, already turned
+// into coverage: distance scaled to destination pixels, from the pixel
+// centre. A pixel is then one horizontal lerp and a clamp.
+static void raster_text_sdf(const canvas_t *cv, font_t *font, int x, int y, const char *s, int color, int bold, int height) {
+	const sdf_t *sdf = font->sdf[font_bold(font, bold)];
+	const unsigned char *g;
+	unsigned short *alpha;
+	unsigned char *fx;
+	unsigned int cp;
+	int *col, *glyphs, *row, *r;
+	int i, j, k, n, len, a, gx, gy, fy, cx1, cx2;
+	int cw = font->cwidth, ch = font->cheight;
+	int x1, y1, x2, y2, step, gain;
+
+	len = utf8_len(s);
+	x1 = x;
+	y1 = y;
+	x2 = x + len * cw * height / ch;
+	y2 = y + height;
+	if(sdf == NULL || height <= 0 || !clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	n = x2 - x1;
+	col = (int*) malloc((n + len + (len + 1) * sdf->w) * sizeof(int) + n * sizeof(short) + n);
+	if(col == NULL) {
+		pprintf("malloc text columns failed");
+		return;
+	}
+	glyphs = col + n;
+	row = glyphs + len; // a slot per glyph, the last one blank
+	alpha = (unsigned short*) (row + (len + 1) * sdf->w);
+	fx = (unsigned char*) (alpha + n);
+
+	step = (ch << 16) / height; // source pixels per destination pixel, 16.16
+	gain = (height << 11) / ch; // field units in 8.8 to coverage in 1/256
+
+	for(i = 0; i < n; i ++) {
+		col[i] = len * sdf->w;
+		fx[i] = 0;
+	}
+	for(i = 0; i < 2; i ++) row[len * sdf->w + i] = -(1 << 22);
+	for(k = 0; (cp = utf8_next(&s)); k ++) {
+		cx1 = x + k * cw * height / ch;
+		cx2 = x + (k + 1) * cw * height / ch;
+		glyphs[k] = cx2 <= x1 || cx1 >= x2 ? -1 : font_index(font, cp);
+		if(glyphs[k] < 0) continue;
+
+		for(i = max(cx1, x1); i < min(cx2, x2); i ++) {
+			gx = ((2 * (i - cx1) + 1) * step >> 1) - (1 << 15) + (SDF_PAD << 16);
+			col[i - x1] = k * sdf->w + (gx >> 16);
+			fx[i - x1] = gx >> 8;
+		}
+	}
+
+	for(j = y1; j < y2; j ++) {
+		gy = ((2 * (j - y) + 1) * step >> 1) - (1 << 15) + (SDF_PAD << 16);
+		fy = gy >> 8 & 0xff;
+		gy >>= 16;
+
+		for(k = 0; k < len; k ++) {
+			if(glyphs[k] < 0) continue;
+
+			g = sdf->data + (glyphs[k] * sdf->h + gy) * sdf->w;
+			r = row + k * sdf->w;
+			for(i = 0; i < sdf->w; i ++) {
+				a = (128 << 8) + ((long long) (g[i] * (256 - fy) + g[i + sdf->w] * fy - (128 << 8)) * gain >> 8);
+				r[i] = max(-(1 << 22), min(1 << 22, a)); // coverage in 1/65536, saturated
+			}
+		}
+
+		for(i = 0; i < n; i ++) {
+			r = row + col[i];
+			a = (r[0] * (256 - fx[i]) + r[1] * fx[i]) >> 16;
+			alpha[i] = max(0, min(256, a));
+		}
+		blend_span(PIXEL(cv, x1, j), alpha, n, color);
+	}
+
+	free(col);
+}
+
+static void raster_fill_rect(const canvas_t *cv, int x, int y, int width, int height, unsigned int color) {
+	char *p;
+	int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+	
+	p = PIXEL(cv, x1, y1);
+	for(y = y1; y < y2; y ++) {
+		fill_span(p, color, x2 - x1);
+		p += cv->pitch;
+	}
+}
+
+static void raster_draw_rect(const canvas_t *cv, int X, int Y, int width, int height, unsigned int color, int weight) {
+	char *p, *p2;
+	int x, y;
+	int x1 = X, y1 = Y, x2 = X + width, y2 = Y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+	
+	p2 = PIXEL(cv, x1, y1);
+	for(y = y1 - Y; y < y2 - Y; y ++) {
+		p = p2;
+		for(x = x1 - X; x < x2 - X; x ++) {
+			if(y < weight || y >= height - weight || x < weight || x >= width - weight) memcpy(p, &color, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+		p2 += cv->pitch;
+	}
+}
+
+typedef struct {
+	int x;
+	int y;
+	int x0;
+	int y0;
+} corner_t;
+
+// weight <= 0 fills the quarter disc, otherwise only the outer ring of weight pixels
+static void raster_corners(const canvas_t *cv, int x, int y, int width, int height, unsigned int color, int weight, int corner) {
+	int i, r;
+	int cx, cy;
+	char *p, *p2;
+	int x1, y1, x2, y2;
+
+	corner_t points[] = {
+		{x, y, corner - 1, corner - 1}, // left top
+		{x, y + height - corner, corner - 1, 0}, // left bottom
+		{x + width - corner, y, 0, corner - 1}, // right top
+		{x + width - corner, y + height - corner, 0, 0} // right bottom
+	};
+
+	for(i = 0; i < sizeof(points)/sizeof(points[0]); i ++) {
+		x1 = points[i].x;
+		y1 = points[i].y;
+		x2 = x1 + corner;
+		y2 = y1 + corner;
+		if(!clip_box(cv, &x1, &y1, &x2, &y2)) continue;
+
+		p2 = PIXEL(cv, x1, y1);
+		for(cy = y1 - points[i].y; cy < y2 - points[i].y; cy ++) {
+			p = p2;
+			for(cx = x1 - points[i].x; cx < x2 - points[i].x; cx ++) {
+				r = sqrt(pow(cx - points[i].x0, 2) + pow(cy - points[i].y0, 2));
+				if(r < corner && (weight <= 0 || r >= corner - weight)) memcpy(p, &color, fb_bpp / 8);
+				p += fb_bpp / 8;
+			}
+			p2 += cv->pitch;
+		}
+	}
+}
+
+static void raster_fill_round_rect(const canvas_t *cv, int x, int y, int width, int height, unsigned int color, int corner) {
+	raster_fill_rect(cv, x + corner, y, width - corner * 2, corner, color); // top
+	raster_fill_rect(cv, x, y + corner, width, height - corner * 2, color); // center
+	raster_fill_rect(cv, x + corner, y + height - corner, width - corner * 2, corner, color); // bottom
+
+	raster_corners(cv, x, y, width, height, color, 0, corner);
+}
+
+static void raster_draw_round_rect(const canvas_t *cv, int x, int y, int width, int height, unsigned int color, int weight, int corner) {
+	raster_fill_rect(cv, x + corner, y, width - corner * 2, weight, color); // top
+	raster_fill_rect(cv, x, y + corner, weight, height - corner * 2, color); // left
+	raster_fill_rect(cv, x + corner, y + height - weight, width - corner * 2, weight, color); // bottom
+	raster_fill_rect(cv, x + width - weight, y + corner, weight, height - corner * 2, color); // right
+
+	raster_corners(cv, x, y, width, height, color, weight, corner);
+}
+
+static void raster_draw_line(const canvas_t *cv, int x1, int y1, int x2, int y2, unsigned int color, int weight) {
+	int x, y;
+	char *p, *p2;
+	int cx, cy;
+	int minX, maxX;
+	int minY, maxY;
+	double x0, y0, radius, cR, cY;
+
+	x0 = (x1 + x2) / 2.0f;
+	y0 = (y1 + y2) / 2.0f;
+	
+	cx = x1 - x2;
+	cy = y1 - y2;
+	
+	cR = sqrt((double)(cy*cy+cx*cx));
+	
+	radius = sqrt(pow(x1 - x0, 2) + pow(y1 - y0, 2)) + weight;
+	
+	minX = min(x1, x2) - weight * 2;
+	maxX = max(x1, x2) + weight * 2 + 1;
+	minY = min(y1, y2) - weight * 2;
+	maxY = max(y1, y2) + weight * 2 + 1;
+	if(!clip_box(cv, &minX, &minY, &maxX, &maxY)) return;
+
+	p2 = PIXEL(cv, minX, minY);
+	for(y = minY; y < maxY; y ++) {
+		p = p2;
+		cY = pow(y - y0, 2);
+		for(x = minX; x < maxX; x ++) {
+			if(sqrt(pow(x - x0, 2) + cY) < radius && (cx || cy) && abs(x*cy-y*cx-x1*cy+y1*cx)/cR <= weight / 2.0f) memcpy(p, &color, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+		p2 += cv->pitch;
+	}
+}
+
+static void oval_focus(int width, int height, double *fx1, double *fy1, double *fx2, double *fy2, double *f) {
+	double a, b;
+
+	a = width / 2.0f;
+	b = height / 2.0f;
+	if(a > b) {
+		*f = sqrt(a * a - b * b);
+		*fx1 = a - *f;
+		*fx2 = a + *f;
+		*fy1 = *fy2 = b;
+		*f = 2.0f * a;
+	} else {
+		*f = sqrt(b * b - a * a);
+		*fx1 = *fx2 = a;
+		*fy1 = b - *f;
+		*fy2 = b + *f;
+		*f = 2.0f * b;
+	}
+}
+
+// weight <= 0 fills the oval
+static void raster_oval(const canvas_t *cv, int X, int Y, int width, int height, unsigned int color, int weight) {
+	char *p, *p2;
+	int x, y;
+	int x1 = X, y1 = Y, x2 = X + width, y2 = Y + height;
+	double a;
+	double fx1,fx2,fy1,fy2;
+	double f;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	oval_focus(width, height, &fx1, &fy1, &fx2, &fy2, &f);
+	
+	p2 = PIXEL(cv, x1, y1);
+	for(y = y1 - Y; y < y2 - Y; y ++) {
+		p = p2;
+		for(x = x1 - X; x < x2 - X; x ++) {
+			a = sqrt(pow(x - fx1, 2) + pow(y - fy1, 2)) + sqrt(pow(x - fx2, 2) + pow(y - fy2, 2));
+			if(weight <= 0 ? a <= f : (a - f <= 0 && a - f >= -weight*2.0f)) memcpy(p, &color, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+		p2 += cv->pitch;
+	}
+}
+
+// weight <= 0 fills the circle
+static void raster_circle(const canvas_t *cv, int X, int Y, int radius, unsigned int color, int weight) {
+	char *p, *p2;
+	int x, y;
+	int side = radius * 2;
+	int x1, y1, x2, y2;
+	int r;
+
+	X -= radius;
+	Y -= radius;
+
+	x1 = X;
+	y1 = Y;
+	x2 = X + side;
+	y2 = Y + side;
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+	
+	p2 = PIXEL(cv, x1, y1);
+	for(y = y1 - Y; y < y2 - Y; y ++) {
+		p = p2;
+		for(x = x1 - X; x < x2 - X; x ++) {
+			if(weight <= 0) {
+				if(sqrt(pow(x - radius, 2) + pow(y - radius, 2)) <= radius) memcpy(p, &color, fb_bpp / 8);
+			} else {
+				r = sqrt(pow(x - radius, 2) + pow(y - radius, 2));
+				if(r < radius && r >= radius - weight) memcpy(p, &color, fb_bpp / 8);
+			}
+			p += fb_bpp / 8;
+		}
+		p2 += cv->pitch;
+	}
+}
+
+static void raster_point(const canvas_t *cv, int x, int y, unsigned int color) {
+	if(x < cv->x1 || x >= cv->x2 || y < cv->y1 || y >= cv->y2) return;
+
+	memcpy(PIXEL(cv, x, y), &color, fb_bpp / 8);
+}
+
+// ramp holds 4 rows, one per y % 4, when dithered
+static void raster_gradient_h(const canvas_t *cv, int x, int y, int width, int height, const char *ramp, int dither) {
+	int j;
+	int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	for(j = y1; j < y2; j ++) {
+		memcpy(PIXEL(cv, x1, j), ramp + ((dither ? (j & 3) : 0) * width + x1 - x) * fb_bpp / 8, (x2 - x1) * fb_bpp / 8);
+	}
+}
+
+// ramp holds 4 columns, one per x % 4, when dithered
+static void raster_gradient_v(const canvas_t *cv, int x, int y, int width, int height, const char *ramp, int dither) {
+	int i, j;
+	char *p;
+	unsigned int color = 0;
+	int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	for(j = y1; j < y2; j ++) {
+		p = PIXEL(cv, x1, j);
+		if(dither) {
+			for(i = x1; i < x2; i ++) {
+				memcpy(p, ramp + ((i & 3) * height + j - y) * fb_bpp / 8, fb_bpp / 8);
+				p += fb_bpp / 8;
+			}
+		} else {
+			memcpy(&color, ramp + (j - y) * fb_bpp / 8, fb_bpp / 8);
+			fill_span(p, color, x2 - x1);
+		}
+	}
+}
+
+typedef struct {
+	int y1, y2; // scanlines y1 <= y < y2
+	long long x; // 16.16 at y1, any int vertex fits
+	long long dx; // 16.16 per scanline
+	int dir;
+} edge_t;
+
+// points are n (x, y) pairs at pixel centers; a pixel is inside when its
+// center is, spans are [ceil(xl), ceil(xr)) so shared edges never overlap
+static void raster_polygon(const canvas_t *cv, const int *points, int n, unsigned int color, int nonzero, int convex) {
+	edge_t stack[32], *edges = stack;
+	long long xs[32], *xs2 = xs, x, xl, xr;
+	int dirs[32], *dirs2 = dirs;
+	int i, j, k, m, num = 0;
+	int y, x1, x2, y1, y2, w;
+	int miny = INT_MAX, maxy = INT_MIN;
+
+	if(n > 32) {
+		edges = (edge_t*) malloc(n * sizeof(edge_t));
+		xs2 = (long long*) malloc(n * sizeof(long long));
+		dirs2 = (int*) malloc(n * sizeof(int));
+		if(edges == NULL || xs2 == NULL || dirs2 == NULL) {
+			pprintf("malloc polygon failed");
+			goto end;
+		}
+	}
+
+	for(i = 0; i < n; i ++) {
+		x1 = points[i * 2];
+		y1 = points[i * 2 + 1];
+		x2 = points[(i + 1) % n * 2];
+		y2 = points[(i + 1) % n * 2 + 1];
+		if(y1 == y2) continue;
+
+		edges[num].dir = 1;
+		if(y1 > y2) {
+			x = x1; x1 = x2; x2 = x;
+			y = y1; y1 = y2; y2 = y;
+			edges[num].dir = -1;
+		}
+		edges[num].y1 = y1;
+		edges[num].y2 = y2;
+		edges[num].x = x1 * 65536ll;
+		edges[num].dx = ((long long) x2 - x1) * 65536 / ((long long) y2 - y1);
+		miny = min(miny, y1);
+		maxy = max(maxy, y2);
+		num ++;
+	}
+
+	// sorted by y1, edges become active in order
+	for(i = 1; i < num; i ++) {
+		edge_t e = edges[i];
+		for(j = i; j > 0 && edges[j - 1].y1 > e.y1; j --) edges[j] = edges[j - 1];
+		edges[j] = e;
+	}
+
+	y1 = max(miny, cv->y1);
+	y2 = min(maxy, cv->y2);
+	for(i = 0; i < num; i ++) { // jump straight to the first visible scanline
+		if(edges[i].y1 < y1) edges[i].x += edges[i].dx * ((long long) min(y1, edges[i].y2) - edges[i].y1);
+	}
+
+	for(y = y1, k = 0; y < y2; y ++) {
+		while(k < num && edges[k].y1 <= y) k ++;
+
+		for(i = m = 0; i < k; i ++) {
+			if(edges[i].y2 <= y) continue;
+			x = edges[i].x;
+			for(j = m; j > 0 && xs2[j - 1] > x; j --) {
+				xs2[j] = xs2[j - 1];
+				dirs2[j] = dirs2[j - 1];
+			}
+			xs2[j] = x;
+			dirs2[j] = edges[i].dir;
+			m ++;
+		}
+
+		for(i = 0; i + 1 < m; ) {
+			if(convex) {
+				xl = xs2[0];
+				xr = xs2[m - 1];
+				i = m;
+			} else if(nonzero) {
+				w = dirs2[i];
+				for(j = i + 1; j < m && (w += dirs2[j]); j ++);
+				if(j >= m) break;
+				xl = xs2[i];
+				xr = xs2[j];
+				i = j + 1;
+			} else {
+				xl = xs2[i];
+				xr = xs2[i + 1];
+				i += 2;
+			}
+
+			x1 = max((xl + 0xffff) >> 16, (long long) cv->x1);
+			x2 = min((xr + 0xffff) >> 16, (long long) cv->x2);
+			if(x1 < x2) fill_span(PIXEL(cv, x1, y), color, x2 - x1);
+		}
+
+		for(i = 0; i < k; i ++) {
+			if(edges[i].y2 > y) edges[i].x += edges[i].dx;
+		}
+	}
+
+end:
+	if(edges != stack) free(edges);
+	if(xs2 != xs) free(xs2);
+	if(dirs2 != dirs) free(dirs2);
+}
+
+static void raster_blit(const canvas_t *cv, int x, int y, int width, int height, const char *pixels, int pitch) {
+	int j;
+	int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	pixels += (y1 - y) * pitch + (x1 - x) * fb_bpp / 8;
+	for(j = y1; j < y2; j ++) {
+		memcpy(PIXEL(cv, x1, j), pixels, (x2 - x1) * fb_bpp / 8);
+		pixels += pitch;
+	}
+}
+
+// points are n (x, y) pairs, each with its own color
+static void raster_points(const canvas_t *cv, const int *points, const unsigned int *colors, int n) {
+	int i, x, y;
+
+	for(i = 0; i < n; i ++) {
+		x = points[i * 2];
+		y = points[i * 2 + 1];
+		if(x >= cv->x1 && x < cv->x2 && y >= cv->y1 && y < cv->y2) memcpy(PIXEL(cv, x, y), &colors[i], fb_bpp / 8);
+	}
+}
+
+typedef struct {
+	unsigned short x, y, w;
+} text_span_t;
+
+// spans are height rows tall, relative to (x, y)
+static void raster_spans(const canvas_t *cv, int x, int y, const text_span_t *spans, int n, int height, unsigned int color) {
+	int i, j, x1, y1, x2, y2;
+
+	for(i = 0; i < n; i ++) {
+		x1 = x + spans[i].x;
+		y1 = y + spans[i].y;
+		x2 = x1 + spans[i].w;
+		y2 = y1 + height;
+		if(!clip_box(cv, &x1, &y1, &x2, &y2)) continue;
+
+		for(j = y1; j < y2; j ++) fill_span(PIXEL(cv, x1, j), color, x2 - x1);
+	}
+}
+
+static void raster_row(const canvas_t *cv, int x, int y, const unsigned int *colors, int n) {
+	int i;
+	char *p;
+	int x1 = x, y1 = y, x2 = x + n, y2 = y + 1;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	p = PIXEL(cv, x1, y);
+	colors += x1 - x;
+	switch(fb_bpp) {
+		case 32:
+			memcpy(p, colors, (x2 - x1) * 4);
+			break;
+		case 16: {
+			unsigned short *p16 = (unsigned short*) p;
+			for(i = 0; i < x2 - x1; i ++) p16[i] = colors[i];
+			break;
+		}
+		default:
+			for(i = 0; i < x2 - x1; i ++) {
+				memcpy(p, &colors[i], fb_bpp / 8);
+				p += fb_bpp / 8;
+			}
+			break;
+	}
+}
+
+static const unsigned char bayer[4][4] = {
+	{ 0,  8,  2, 10},
+	{12,  4, 14,  6},
+	{ 3, 11,  1,  9},
+	{15,  7, 13,  5}
+};
+
+// ramp holds radius + 1 pixels per dither threshold when dithered
+static void raster_gradient_radial(const canvas_t *cv, int x, int y, int width, int height, int cx, int cy, int radius, const char *ramp, int dither) {
+	int i, j, d;
+	char *p;
+	int x1 = x, y1 = y, x2 = x + width, y2 = y + height;
+
+	if(!clip_box(cv, &x1, &y1, &x2, &y2)) return;
+
+	for(j = y1; j < y2; j ++) {
+		p = PIXEL(cv, x1, j);
+		for(i = x1; i < x2; i ++) {
+			d = sqrt((i - cx) * (i - cx) + (j - cy) * (j - cy));
+			if(d > radius) d = radius;
+			memcpy(p, ramp + ((dither ? bayer[j & 3][i & 3] : 0) * (radius + 1) + d) * fb_bpp / 8, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+	}
+}
+
+// Drawing commands. With one thread every command is rasterized as soon as
+// it is submitted. With a worker pool, commands are recorded, binned into
+// TILE_SIZE screen tiles and rasterized per tile at fb_flush(); every tile
+// replays its commands in submission order, so the result is identical.
+typedef enum {
+	CMD_FILL_RECT,
+	CMD_DRAW_RECT,
+	CMD_FILL_ROUND_RECT,
+	CMD_DRAW_ROUND_RECT,
+	CMD_OVAL,
+	CMD_CIRCLE,
+	CMD_LINE,
+	CMD_POINT,
+	CMD_TEXT,
+	CMD_TEXT_FX,
+	CMD_TEXT_SDF,
+	CMD_GRADIENT_H,
+	CMD_GRADIENT_V,
+	CMD_GRADIENT_RADIAL,
+	CMD_POLYGON,
+	CMD_BLIT,
+	CMD_POINTS,
+	CMD_ROW,
+	CMD_SPANS,
+} cmd_type_t;
+
+typedef struct {
+	cmd_type_t type;
+	int x1, y1, x2, y2; // bounding box, x2 and y2 exclusive
+	int a[8];
+	unsigned int color;
+	font_t *font;
+	const glyph_cache_t *glyphs;
+	const void *data; // payload, copied into the arena while recorded unless size is 0
+	size_t size;
+} cmd_t;
+
+#define TILE_SIZE 64
+
+typedef struct {
+	unsigned int *cmds;
+	int num;
+	int cap;
+} tile_t;
+
+typedef struct {
+	pthread_t tid;
+	atomic_int head; // next entry of tile_order to take, owner and thieves alike
+	int tail;
+	unsigned int gen;
+} worker_t;
+
+static cmd_t *cmds = NULL;
+static int cmd_num = 0, cmd_cap = 0;
+static char *arena = NULL;
+static size_t arena_len = 0, arena_cap = 0;
+static tile_t *tiles = NULL;
+static int tiles_x = 0, tiles_y = 0;
+static int *tile_order = NULL;
+
+static worker_t *workers = NULL;
+static int worker_num = 1;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned int pool_gen = 0;
+static int pool_busy = 0;
+static bool pool_exit = false;
+
+static void cmd_exec(const cmd_t *c, const canvas_t *cv) {
+	switch(c->type) {
+		case CMD_FILL_RECT:
+			raster_fill_rect(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color);
+			break;
+		case CMD_DRAW_RECT:
+			raster_draw_rect(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color, c->a[4]);
+			break;
+		case CMD_FILL_ROUND_RECT:
+			raster_fill_round_rect(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color, c->a[5]);
+			break;
+		case CMD_DRAW_ROUND_RECT:
+			raster_draw_round_rect(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color, c->a[4], c->a[5]);
+			break;
+		case CMD_OVAL:
+			raster_oval(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color, c->a[4]);
+			break;
+		case CMD_CIRCLE:
+			raster_circle(cv, c->a[0], c->a[1], c->a[2], c->color, c->a[4]);
+			break;
+		case CMD_LINE:
+			raster_draw_line(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->color, c->a[4]);
+			break;
+		case CMD_POINT:
+			raster_point(cv, c->a[0], c->a[1], c->color);
+			break;
+		case CMD_TEXT:
+			raster_text(cv, c->font, c->glyphs, c->a[0], c->a[1], c->data, c->color, c->a[4], c->a[5]);
+			break;
+		case CMD_TEXT_FX:
+			raster_text_fx(cv, c->font, c->a[0], c->a[1], (const char*) c->data + sizeof(fb_text_fx_t), c->color, c->a[4], c->a[5], c->data);
+			break;
+		case CMD_TEXT_SDF:
+			raster_text_sdf(cv, c->font, c->a[0], c->a[1], c->data, c->color, c->a[4], c->a[5]);
+			break;
+		case CMD_GRADIENT_H:
+			raster_gradient_h(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->data, c->a[4]);
+			break;
+		case CMD_GRADIENT_V:
+			raster_gradient_v(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->data, c->a[4]);
+			break;
+		case CMD_GRADIENT_RADIAL:
+			raster_gradient_radial(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->a[5], c->a[6], c->a[7], c->data, c->a[4]);
+			break;
+		case CMD_POLYGON:
+			raster_polygon(cv, c->data, c->a[0], c->color, c->a[1], c->a[2]);
+			break;
+		case CMD_BLIT:
+			raster_blit(cv, c->a[0], c->a[1], c->a[2], c->a[3], c->data, c->a[4]);
+			break;
+		case CMD_POINTS:
+			raster_points(cv, c->data, (const unsigned int*) ((const int*) c->data + c->a[0] * 2), c->a[0]);
+			break;
+		case CMD_ROW:
+			raster_row(cv, c->a[0], c->a[1], c->data, c->a[2]);
+			break;
+		case CMD_SPANS:
+			raster_spans(cv, c->a[0], c->a[1], c->data, c->a[2], c->a[3], c->color);
+			break;
+	}
+}
+
+static void tile_exec(int t) {
+	tile_t *tile = &tiles[t];
+	canvas_t cv = fb_canvas;
+	int i;
+
+	cv.x1 = (t % tiles_x) * TILE_SIZE;
+	cv.y1 = (t / tiles_x) * TILE_SIZE;
+	cv.x2 = min(cv.x1 + TILE_SIZE, fb_width);
+	cv.y2 = min(cv.y1 + TILE_SIZE, fb_height);
+
+	for(i = 0; i < tile->num; i ++) cmd_exec(&cmds[tile->cmds[i]], &cv);
+}
+
+// drain the own queue first, then steal tiles from the other workers
+static void pool_run(int self) {
+	worker_t *w;
+	int i, t;
+
+	for(i = 0; i < worker_num; i ++) {
+		w = &workers[(self + i) % worker_num];
+		while((t = atomic_fetch_add(&w->head, 1)) < w->tail) tile_exec(tile_order[t]);
+	}
+}
+
+static void *pool_main(void *arg) {
+	worker_t *w = (worker_t*) arg;
+
+	for(;;) {
+		pthread_mutex_lock(&pool_lock);
+		while(w->gen == pool_gen && !pool_exit) pthread_cond_wait(&pool_cond, &pool_lock);
+		if(pool_exit) {
+			pthread_mutex_unlock(&pool_lock);
+			break;
+		}
+		w->gen = pool_gen;
+		pthread_mutex_unlock(&pool_lock);
+
+		pool_run(w - workers);
+
+		pthread_mutex_lock(&pool_lock);
+		if(--pool_busy == 0) pthread_cond_signal(&pool_done);
+		pthread_mutex_unlock(&pool_lock);
+	}
+
+	return NULL;
+}
+
+static void pool_free(void) {
+	int i;
+
+	if(workers) {
+		pthread_mutex_lock(&pool_lock);
+		pool_exit = true;
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+
+		for(i = 1; i < worker_num; i ++) pthread_join(workers[i].tid, NULL);
+
+		pool_exit = false;
+		free(workers);
+		workers = NULL;
+	}
+	worker_num = 1;
+
+	if(tiles) {
+		for(i = 0; i < tiles_x * tiles_y; i ++) free(tiles[i].cmds);
+		free(tiles);
+		tiles = NULL;
+	}
+	tiles_x = tiles_y = 0;
+
+	free(tile_order);
+	tile_order = NULL;
+	free(cmds);
+	cmds = NULL;
+	cmd_num = cmd_cap = 0;
+	free(arena);
+	arena = NULL;
+	arena_len = arena_cap = 0;
+}
+
+int fb_threads(int n) {
+	int i;
+
+	if(n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1) n = 1;
+
+	fb_flush();
+	pool_free();
+
+	if(n == 1) return FB_OK;
+
+	FB_ASSERT;
+	
+	tiles_x = (fb_width + TILE_SIZE - 1) / TILE_SIZE;
+	tiles_y = (fb_height + TILE_SIZE - 1) / TILE_SIZE;
+	tiles = (tile_t*) calloc(tiles_x * tiles_y, sizeof(tile_t));
+	tile_order = (int*) malloc(tiles_x * tiles_y * sizeof(int));
+	workers = (worker_t*) calloc(n, sizeof(worker_t));
+	if(tiles == NULL || tile_order == NULL || workers == NULL) {
+		pprintf("malloc tiles failed");
+		pool_free();
+		return FB_ERR;
+	}
+
+	worker_num = 1;
+	for(i = 1; i < n; i ++) {
+		workers[i].gen = pool_gen;
+		if(pthread_create(&workers[i].tid, NULL, pool_main, &workers[i])) {
+			pprintf("pthread_create failed");
+			break;
+		}
+		worker_num ++;
+	}
+	dprintf("raster threads: %d, tiles: %dx%d\n", worker_num, tiles_x, tiles_y);
+
+	return FB_OK;
+}
+
+static bool tile_push(tile_t *tile, unsigned int idx) {
+	if(tile->num == tile->cap) {
+		int cap = tile->cap ? tile->cap * 2 : 64;
+		unsigned int *p = (unsigned int*) realloc(tile->cmds, cap * sizeof(unsigned int));
+
+		if(p == NULL) return false;
+		tile->cmds = p;
+		tile->cap = cap;
+	}
+	tile->cmds[tile->num ++] = idx;
+
+	return true;
+}
+
+static bool cmd_push(const cmd_t *c) {
+	size_t len = arena_len;
+	int tx, ty;
+	tile_t *tile;
+	cmd_t *p;
+
+	if(cmd_num == cmd_cap) {
+		int cap = cmd_cap ? cmd_cap * 2 : 1024;
+
+		p = (cmd_t*) realloc(cmds, cap * sizeof(cmd_t));
+		if(p == NULL) return false;
+		cmds = p;
+		cmd_cap = cap;
+	}
+
+	if(arena_len + c->size > arena_cap) {
+		size_t cap = arena_cap ? arena_cap : 4096;
+		char *a;
+
+		while(cap < arena_len + c->size) cap *= 2;
+		a = (char*) realloc(arena, cap);
+		if(a == NULL) return false;
+		arena = a;
+		arena_cap = cap;
+	}
+
+	p = &cmds[cmd_num];
+	*p = *c;
+	if(c->size) {
+		memcpy(arena + arena_len, c->data, c->size);
+		p->data = (void*) arena_len; // resolved by fb_flush(), the arena may move
+		arena_len += (c->size + 7) & ~7;
+	}
+
+	for(ty = c->y1 / TILE_SIZE; ty <= (c->y2 - 1) / TILE_SIZE; ty ++) {
+		for(tx = c->x1 / TILE_SIZE; tx <= (c->x2 - 1) / TILE_SIZE; tx ++) {
+			if(!tile_push(&tiles[ty * tiles_x + tx], cmd_num)) goto undo;
+		}
+	}
+	cmd_num ++;
+
+	return true;
+
+undo: // the tiles it got onto drop it again, fb_flush() must not see it
+	for(ty = c->y1 / TILE_SIZE; ty <= (c->y2 - 1) / TILE_SIZE; ty ++) {
+		for(tx = c->x1 / TILE_SIZE; tx <= (c->x2 - 1) / TILE_SIZE; tx ++) {
+			tile = &tiles[ty * tiles_x + tx];
+			if(tile->num && tile->cmds[tile->num - 1] == (unsigned int) cmd_num) tile->num --;
+		}
+	}
+	arena_len = len;
+
+	return false;
+}
+
+static void cmd_submit(cmd_t *c) {
+	if(c->x1 < 0) c->x1 = 0;
+	if(c->y1 < 0) c->y1 = 0;
+	if(c->x2 > fb_target->width) c->x2 = fb_target->width;
+	if(c->y2 > fb_target->height) c->y2 = fb_target->height;
+	if(c->x1 >= c->x2 || c->y1 >= c->y2) return;
+
+	if(fb_target != &fb_canvas) { // sprites are small, always drawn right away
+		cmd_exec(c, fb_target);
+		return;
+	}
+
+	fb_damage(c->x1, c->y1, c->x2 - c->x1, c->y2 - c->y1);
+
+	if(worker_num > 1) {
+		// a point on a tile without pending work can be written right away
+		if(c->type == CMD_POINT && tiles[c->y1 / TILE_SIZE * tiles_x + c->x1 / TILE_SIZE].num == 0) {
+			cmd_exec(c, &fb_canvas);
+			return;
+		}
+		if(cmd_push(c)) return;
+
+		eprintf("record draw command failed\n");
+		fb_flush();
+	}
+
+	cmd_exec(c, &fb_canvas);
+}
+
+void fb_flush(void) {
+	int i, n;
+
+	flush_gen ++;
+
+	if(cmd_num == 0) return;
+
+	for(i = 0; i < cmd_num; i ++) {
+		if(cmds[i].size) cmds[i].data = arena + (size_t) cmds[i].data;
+	}
+
+	for(i = n = 0; i < tiles_x * tiles_y; i ++) {
+		if(tiles[i].num) tile_order[n ++] = i;
+	}
+
+	for(i = 0; i < worker_num; i ++) {
+		atomic_store(&workers[i].head, n * i / worker_num);
+		workers[i].tail = n * (i + 1) / worker_num;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_busy = worker_num - 1;
+	pool_gen ++;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	pool_run(0);
+
+	pthread_mutex_lock(&pool_lock);
+	while(pool_busy) pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	for(i = 0; i < tiles_x * tiles_y; i ++) tiles[i].num = 0;
+	cmd_num = 0;
+	arena_len = 0;
+}
+
+#define CMD(t,bx,by,bw,bh,c) {.type = t, .x1 = (bx), .y1 = (by), .x2 = (bx) + (bw), .y2 = (by) + (bh), .color = c}
+
+void fb_text(int x, int y, const char *s, int color, int bold, int size) {
+	cmd_t c = CMD(CMD_TEXT, x, y, font->cwidth * size * utf8_len(s), font->cheight * size, color);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[4] = bold;
+	c.a[5] = size;
+	c.font = font;
+	if(size > 1) c.glyphs = glyph_cache_get(font, bold, size);
+	c.data = s;
+	c.size = strlen(s) + 1;
+	cmd_submit(&c);
+}
+
+// smooth text of any pixel height, scaled from the font's distance fields
+void fb_text_sdf(int x, int y, const char *s, int color, int bold, int height) {
+	cmd_t c = CMD(CMD_TEXT_SDF, x, y, utf8_len(s) * (int) font->cwidth * height / (int) font->cheight, height, color);
+
+	if(height <= 0) return;
+	if(sdf_prepare(font, font_bold(font, bold), s) == NULL) {
+		fb_text(x, y, s, color, bold, max(1, height / (int) font->cheight));
+		return;
+	}
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[4] = bold;
+	c.a[5] = height;
+	c.font = font;
+	c.data = s;
+	c.size = strlen(s) + 1;
+	cmd_submit(&c);
+}
+
+// text with shadow, outline and bevel layers drawn in one pass
+void fb_text_fx(int x, int y, const char *s, int color, int bold, int size, const fb_text_fx_t *fx) {
+	int left, top, right, bottom, len = strlen(s);
+	cmd_t c = CMD(CMD_TEXT_FX, x, y, font->cwidth * size * utf8_len(s), font->cheight * size, color);
+	char *data;
+
+	text_fx_margins(fx, &left, &top, &right, &bottom);
+	c.x1 -= left;
+	c.y1 -= top;
+	c.x2 += right;
+	c.y2 += bottom;
+
+	// effects and string travel as one payload
+	data = (char*) malloc(sizeof(fb_text_fx_t) + len + 1);
+	if(data == NULL) {
+		pprintf("malloc text fx failed");
+		return;
+	}
+	memcpy(data, fx, sizeof(fb_text_fx_t));
+	memcpy(data + sizeof(fb_text_fx_t), s, len + 1);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[4] = bold;
+	c.a[5] = size;
+	c.font = font;
+	c.data = data;
+	c.size = sizeof(fb_text_fx_t) + len + 1;
+	cmd_submit(&c);
+
+	free(data);
+}
+
+void fb_text_measure(const char *s, int size, int *width, int *height) {
+	if(width) *width = font->cwidth * size * utf8_len(s);
+	if(height) *height = font->cheight * size;
+}
+
+#define FB_ASSERT_POINT(x,y) assert((x >= 0 && x < fb_target->width) && (y >= 0 && y < fb_target->height))
+#define FB_ASSERT_RECT(x,y,w,h) assert((x >= 0 && y >= 0) && (w > 0 && h > 0) && (x + w <= fb_target->width && y + h <= fb_target->height))
+
+void fb_fill_rect(int x, int y, int width, int height, unsigned int color) {
+	cmd_t c = CMD(CMD_FILL_RECT, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	cmd_submit(&c);
+}
+
+void fb_draw_rect(int x, int y, int width, int height, unsigned int color, int weight) {
+	cmd_t c = CMD(CMD_DRAW_RECT, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = weight;
+	cmd_submit(&c);
+}
+
+void fb_fill_round_rect(int x, int y, int width, int height, unsigned int color, int corner) {
+	cmd_t c = CMD(CMD_FILL_ROUND_RECT, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[5] = corner;
+	cmd_submit(&c);
+}
+
+void fb_draw_round_rect(int x, int y, int width, int height, unsigned int color, int weight, int corner) {
+	cmd_t c = CMD(CMD_DRAW_ROUND_RECT, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = weight;
+	c.a[5] = corner;
+	cmd_submit(&c);
+}
+
+void fb_draw_line(int x1, int y1, int x2, int y2, unsigned int color, int weight) {
+	cmd_t c = CMD(CMD_LINE, min(x1, x2) - weight * 2, min(y1, y2) - weight * 2, abs(x1 - x2) + weight * 4 + 1, abs(y1 - y2) + weight * 4 + 1, color);
+
+	FB_ASSERT_POINT(x1, y1);
+	FB_ASSERT_POINT(x2, y2);
+
+	c.a[0] = x1;
+	c.a[1] = y1;
+	c.a[2] = x2;
+	c.a[3] = y2;
+	c.a[4] = weight;
+	cmd_submit(&c);
+}
+
+void fb_fill_oval(int x, int y, int width, int height, unsigned int color) {
+	cmd_t c = CMD(CMD_OVAL, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = 0;
+	cmd_submit(&c);
+}
+
+void fb_draw_oval(int x, int y, int width, int height, unsigned int color, int weight) {
+	cmd_t c = CMD(CMD_OVAL, x, y, width, height, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = weight;
+	cmd_submit(&c);
+}
+
+void fb_fill_circle(int x, int y, int radius, unsigned int color) {
+	cmd_t c = CMD(CMD_CIRCLE, x - radius, y - radius, radius * 2, radius * 2, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x - radius, y - radius, radius * 2, radius * 2);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = radius;
+	c.a[4] = 0;
+	cmd_submit(&c);
+}
+
+void fb_draw_circle(int x, int y, int radius, unsigned int color, int weight) {
+	cmd_t c = CMD(CMD_CIRCLE, x - radius, y - radius, radius * 2, radius * 2, color);
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x - radius, y - radius, radius * 2, radius * 2);
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = radius;
+	c.a[4] = weight;
+	cmd_submit(&c);
 }
 
 void fb_draw_point(int x, int y, unsigned int color) {
+	cmd_t c = CMD(CMD_POINT, x, y, 1, 1, color);
+
 	FB_ASSERT_POINT(x, y);
 
-	memcpy(fb_newbuf + y * fb_xsize + x * fb_bpp / 8, &color, fb_bpp / 8);
+	c.a[0] = x;
+	c.a[1] = y;
+	cmd_submit(&c);
+}
+
+// points are n (x, y) pairs, each with its own color; points off the target are skipped
+void fb_draw_points(const int *points, const unsigned int *colors, int n) {
+	cmd_t c = CMD(CMD_POINTS, 0, 0, 0, 0, 0);
+	int i, minx = INT_MAX, miny = INT_MAX, maxx = INT_MIN, maxy = INT_MIN;
+	char *data;
+
+	FB_ASSERT;
+
+	if(n <= 0) return;
+
+	for(i = 0; i < n; i ++) {
+		minx = min(minx, points[i * 2]);
+		maxx = max(maxx, points[i * 2]);
+		miny = min(miny, points[i * 2 + 1]);
+		maxy = max(maxy, points[i * 2 + 1]);
+	}
+
+	// points and colors travel as one payload
+	data = (char*) malloc(n * (2 * sizeof(int) + sizeof(unsigned int)));
+	if(data == NULL) {
+		pprintf("malloc points failed");
+		return;
+	}
+	memcpy(data, points, n * 2 * sizeof(int));
+	memcpy(data + n * 2 * sizeof(int), colors, n * sizeof(unsigned int));
+
+	c.x1 = minx;
+	c.y1 = miny;
+	c.x2 = maxx + 1;
+	c.y2 = maxy + 1;
+	c.a[0] = n;
+	c.data = data;
+	c.size = n * (2 * sizeof(int) + sizeof(unsigned int));
+	cmd_submit(&c);
+
+	free(data);
+}
+
+// n colors from (x, y) to the right, clipped to the target
+void fb_draw_row(int x, int y, const unsigned int *colors, int n) {
+	cmd_t c = CMD(CMD_ROW, x, y, n, 1, 0);
+
+	FB_ASSERT;
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = n;
+	c.data = colors;
+	c.size = n * sizeof(unsigned int);
+	cmd_submit(&c);
+}
+
+// n native pixels from (x, y) to the right, clipped to the target
+void fb_put_row(int x, int y, const void *pixels, int n) {
+	cmd_t c = CMD(CMD_BLIT, x, y, n, 1, 0);
+
+	FB_ASSERT;
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = n;
+	c.a[3] = 1;
+	c.a[4] = n * fb_bpp / 8;
+	c.data = pixels;
+	c.size = n * fb_bpp / 8;
+	cmd_submit(&c);
+}
+
+// channels widened to 8 bits
+static void color_split(unsigned int color, int rgb[3]) {
+	const struct fb_bitfield *f[] = {&fb_vinfo.red, &fb_vinfo.green, &fb_vinfo.blue};
+	int i, c, len;
+
+	for(i = 0; i < 3; i ++) {
+		len = f[i]->length;
+		c = (color >> f[i]->offset) & ((1 << len) - 1);
+		if(len >= 8) rgb[i] = c >> (len - 8);
+		else if(len >= 4) rgb[i] = (c << (8 - len)) | (c >> (2 * len - 8));
+		else rgb[i] = c << (8 - len);
+	}
+}
+
+// step i of n between rgb1 and rgb2, th is the ordered dither threshold 0..15
+static unsigned int gradient_color(const int rgb1[3], const int rgb2[3], int i, int n, int th) {
+	const struct fb_bitfield *f[] = {&fb_vinfo.red, &fb_vinfo.green, &fb_vinfo.blue};
+	unsigned int color = fb_vinfo.transp.length ? (0xffu << fb_vinfo.transp.offset) : 0;
+	int k, v, len, shift;
+
+	for(k = 0; k < 3; k ++) {
+		len = min(f[k]->length, 8);
+		shift = 16 - len;
+		v = rgb1[k] * 256 + (long) (rgb2[k] - rgb1[k]) * 256 * i / (n ? n : 1); // 8.8 fixed point
+		v = (v + ((th << shift) >> 4)) >> shift;
+		if(v > (1 << len) - 1) v = (1 << len) - 1;
+		color |= (unsigned int) v << f[k]->offset;
+	}
+
+	return color;
+}
+
+// only worth it when a channel is narrower than 8 bits
+static bool gradient_dither(void) {
+	return fb_vinfo.red.length < 8 || fb_vinfo.green.length < 8 || fb_vinfo.blue.length < 8;
+}
+
+void fb_fill_gradient_linear(int x, int y, int width, int height, unsigned int color1, unsigned int color2, int vertical, int dither) {
+	cmd_t c = CMD(vertical ? CMD_GRADIENT_V : CMD_GRADIENT_H, x, y, width, height, 0);
+	int n = vertical ? height : width;
+	int rgb1[3], rgb2[3];
+	int i, k, rows, th;
+	unsigned int color;
+	char *ramp, *p;
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	dither = dither && gradient_dither();
+	rows = dither ? 4 : 1;
+
+	p = ramp = (char*) malloc(rows * n * fb_bpp / 8);
+	if(ramp == NULL) {
+		pprintf("malloc gradient failed");
+		return;
+	}
+
+	color_split(color1, rgb1);
+	color_split(color2, rgb2);
+	for(k = 0; k < rows; k ++) {
+		for(i = 0; i < n; i ++) {
+			th = dither ? (vertical ? bayer[(y + i) & 3][k] : bayer[k][(x + i) & 3]) : 0;
+			color = gradient_color(rgb1, rgb2, i, n - 1, th);
+			memcpy(p, &color, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+	}
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = dither;
+	c.data = ramp;
+	c.size = rows * n * fb_bpp / 8;
+	cmd_submit(&c);
+
+	free(ramp);
+}
+
+void fb_fill_gradient_radial(int x, int y, int width, int height, int cx, int cy, int radius, unsigned int color1, unsigned int color2, int dither) {
+	cmd_t c = CMD(CMD_GRADIENT_RADIAL, x, y, width, height, 0);
+	int rgb1[3], rgb2[3];
+	int i, k, rows;
+	unsigned int color;
+	char *ramp, *p;
+
+	FB_ASSERT;
+	FB_ASSERT_RECT(x, y, width, height);
+
+	if(radius < 1) radius = 1;
+	dither = dither && gradient_dither();
+	rows = dither ? 16 : 1;
+
+	p = ramp = (char*) malloc(rows * (radius + 1) * fb_bpp / 8);
+	if(ramp == NULL) {
+		pprintf("malloc gradient failed");
+		return;
+	}
+
+	color_split(color1, rgb1);
+	color_split(color2, rgb2);
+	for(k = 0; k < rows; k ++) {
+		for(i = 0; i <= radius; i ++) {
+			color = gradient_color(rgb1, rgb2, i, radius, k);
+			memcpy(p, &color, fb_bpp / 8);
+			p += fb_bpp / 8;
+		}
+	}
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = width;
+	c.a[3] = height;
+	c.a[4] = dither;
+	c.a[5] = cx;
+	c.a[6] = cy;
+	c.a[7] = radius;
+	c.data = ramp;
+	c.size = rows * (radius + 1) * fb_bpp / 8;
+	cmd_submit(&c);
+
+	free(ramp);
+}
+
+// all turns go the same way and x changes direction at most twice; the
+// second test rejects stars, which also turn one way but wind twice
+static bool polygon_convex(const int *points, int n) {
+	int i, d, dx = 0, sign = 0, flips = 0;
+	long long cross;
+
+	for(i = 0; i < n; i ++) {
+		const int *a = points + i * 2, *b = points + (i + 1) % n * 2, *c = points + (i + 2) % n * 2;
+
+		cross = ((long long) b[0] - a[0]) * ((long long) c[1] - b[1]) - ((long long) b[1] - a[1]) * ((long long) c[0] - b[0]);
+		if(cross != 0) {
+			if(sign == 0) sign = cross > 0 ? 1 : -1;
+			else if((cross > 0 ? 1 : -1) != sign) return false;
+		}
+
+		d = (b[0] > a[0]) - (b[0] < a[0]); // the x direction alone
+		if(d != 0) {
+			if(dx != 0 && d != dx) flips ++;
+			dx = d;
+		}
+	}
+
+	return flips <= 2;
+}
+
+void fb_fill_polygon(const int *points, int n, unsigned int color, int nonzero) {
+	cmd_t c = CMD(CMD_POLYGON, 0, 0, 0, 0, color);
+	int i, minx = INT_MAX, miny = INT_MAX, maxx = INT_MIN, maxy = INT_MIN;
+
+	FB_ASSERT;
+	assert(points && n >= 3);
+
+	for(i = 0; i < n; i ++) {
+		minx = min(minx, points[i * 2]);
+		maxx = max(maxx, points[i * 2]);
+		miny = min(miny, points[i * 2 + 1]);
+		maxy = max(maxy, points[i * 2 + 1]);
+	}
+
+	c.x1 = minx;
+	c.y1 = miny;
+	c.x2 = maxx + 1;
+	c.y2 = maxy + 1;
+	c.a[0] = n;
+	c.a[1] = nonzero;
+	c.a[2] = polygon_convex(points, n);
+	c.data = points;
+	c.size = n * 2 * sizeof(int);
+	cmd_submit(&c);
+}
+
+void fb_fill_triangle(int x1, int y1, int x2, int y2, int x3, int y3, unsigned int color) {
+	int points[] = {x1, y1, x2, y2, x3, y3};
+
+	fb_fill_polygon(points, 3, color, 0);
+}
+
+struct fb_sprite {
+	canvas_t cv;
+	char pixels[];
+};
+
+fb_sprite_t *fb_sprite_new(int width, int height) {
+	fb_sprite_t *sprite;
+
+	FB_ASSERT;
+	assert(width > 0 && height > 0);
+
+	sprite = (fb_sprite_t*) calloc(1, sizeof(fb_sprite_t) + width * height * fb_bpp / 8);
+	if(sprite == NULL) {
+		pprintf("malloc sprite failed");
+		return NULL;
+	}
+
+	sprite->cv.buf = sprite->pixels;
+	sprite->cv.pitch = width * fb_bpp / 8;
+	sprite->cv.width = sprite->cv.x2 = width;
+	sprite->cv.height = sprite->cv.y2 = height;
+
+	return sprite;
+}
+
+void fb_sprite_free(fb_sprite_t *sprite) {
+	if(sprite == NULL) return;
+
+	if(fb_target == &sprite->cv) fb_target = &fb_canvas;
+	fb_flush(); // recorded blits may still point at it
+	free(sprite);
+}
+
+// NULL draws to the screen again
+void fb_sprite_target(fb_sprite_t *sprite) {
+	if(sprite) {
+		fb_flush(); // recorded blits must see the old pixels
+		fb_target = &sprite->cv;
+	} else {
+		fb_target = &fb_canvas;
+	}
+}
+
+int fb_sprite_width(const fb_sprite_t *sprite) {
+	return sprite->cv.width;
+}
+
+int fb_sprite_height(const fb_sprite_t *sprite) {
+	return sprite->cv.height;
+}
+
+// the sprite is referenced, not copied, until the next fb_flush()
+void fb_draw_sprite(int x, int y, const fb_sprite_t *sprite) {
+	cmd_t c = CMD(CMD_BLIT, x, y, sprite->cv.width, sprite->cv.height, 0);
+
+	FB_ASSERT;
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = sprite->cv.width;
+	c.a[3] = sprite->cv.height;
+	c.a[4] = sprite->cv.pitch;
+	c.data = sprite->pixels;
+	cmd_submit(&c);
+}
+
+// A string laid out once as merged horizontal spans of scaled pixels;
+// fb_text_run_set() lays it out again only when the text or the font changed.
+struct fb_text_run {
+	font_t *font;
+	int color, bold, size;
+	int width, height;
+	unsigned int gen; // fb_flush() generation of the last draw
+	char *text;
+	text_span_t *spans;
+	int span_num, span_max;
+};
+
+fb_text_run_t *fb_text_run_new(int color, int bold, int size) {
+	fb_text_run_t *run;
+
+	assert(size > 0);
+
+	run = (fb_text_run_t*) calloc(1, sizeof(fb_text_run_t));
+	if(run == NULL) {
+		pprintf("malloc text run failed");
+		return NULL;
+	}
+
+	run->color = color;
+	run->bold = bold;
+	run->size = size;
+	run->gen = flush_gen - 1;
+
+	return run;
+}
+
+void fb_text_run_free(fb_text_run_t *run) {
+	if(run == NULL) return;
+
+	if(run->gen == flush_gen) fb_flush(); // recorded draws reference the spans
+	free(run->text);
+	free(run->spans);
+	free(run);
+}
+
+static int text_run_span(fb_text_run_t *run, int x, int y, int w) {
+	text_span_t *sp;
+
+	if(run->span_num > 0) {
+		sp = &run->spans[run->span_num - 1];
+		if(sp->y == y && sp->x + sp->w == x) {
+			sp->w += w;
+			return FB_OK;
+		}
+	}
+
+	if(run->span_num == run->span_max) {
+		int max = run->span_max ? run->span_max * 2 : 64;
+
+		sp = (text_span_t*) realloc(run->spans, max * sizeof(text_span_t));
+		if(sp == NULL) {
+			pprintf("realloc text spans failed");
+			return FB_ERR;
+		}
+		run->spans = sp;
+		run->span_max = max;
+	}
+
+	sp = &run->spans[run->span_num ++];
+	sp->x = x;
+	sp->y = y;
+	sp->w = w;
+
+	return FB_OK;
+}
+
+// returns 1 when the run was laid out again
+int fb_text_run_set(fb_text_run_t *run, const char *s) {
+	unsigned int buf[FONT_MAX_HEIGHT];
+	const unsigned int *rows;
+	unsigned int cp, m, r, i, start;
+	int k, glyph, bold = font_bold(font, run->bold);
+	char *text;
+	const char *p;
+
+	FB_ASSERT;
+
+	if(run->text && run->font == font && !strcmp(run->text, s)) return 0;
+
+	text = strdup(s);
+	if(text == NULL) {
+		pprintf("strdup text run failed");
+		return 0;
+	}
+
+	if(run->gen == flush_gen) fb_flush(); // recorded draws reference the spans
+
+	free(run->text);
+	run->text = text;
+	run->font = font;
+	run->span_num = 0;
+	fb_text_measure(s, run->size, &run->width, &run->height);
+
+	for(r = 0; r < font->cheight; r ++) {
+		for(p = s, k = 0; (cp = utf8_next(&p)); k ++) {
+			if((glyph = font_index(font, cp)) < 0) continue;
+
+			rows = font_glyph(font, bold, glyph, buf);
+			for(m = rows[r], i = 0; i < font->cwidth; ) {
+				if(!(m >> i & 1)) {
+					i ++;
+					continue;
+				}
+				for(start = i; i < font->cwidth && (m >> i & 1); i ++);
+				if(text_run_span(run, (k * font->cwidth + start) * run->size, r * run->size, (i - start) * run->size) == FB_ERR) {
+					run->span_num = 0;
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+// the spans are referenced, not copied, until the next fb_flush()
+void fb_draw_text_run(int x, int y, fb_text_run_t *run) {
+	cmd_t c = CMD(CMD_SPANS, x, y, run->width, run->height, run->color);
+
+	FB_ASSERT;
+
+	if(run->span_num == 0) return;
+
+	c.a[0] = x;
+	c.a[1] = y;
+	c.a[2] = run->span_num;
+	c.a[3] = run->size;
+	c.data = run->spans;
+	cmd_submit(&c);
+	run->gen = flush_gen;
+}
+
+int fb_text_run_width(const fb_text_run_t *run) {
+	return run->width;
+}
+
+int fb_text_run_height(const fb_text_run_t *run) {
+	return run->height;
 }
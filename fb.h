@@ -19,7 +19,11 @@ int fb_free(void);
 int fb_save(void);
 int fb_restore(void);
 
-void fb_sync(void);
+void fb_sync(void); // what was drawn since the last sync onto the screen
+void fb_damage(int x, int y, int width, int height); // ... and this too, the screen lost it
+
+int fb_threads(int n);
+void fb_flush(void);
 
 int fb_color(int red, int green, int blue);
 int fb_color_add(int color, int add);
@@ -32,17 +36,43 @@ typedef enum {
 } font_family_t;
 
 void fb_set_font(font_family_t family);
+int fb_load_font(const char *path); // a font_family_t for fb_set_font()
 
 int fb_font_width();
 int fb_font_height();
 
 void fb_text(int x, int y, const char *s, int color, int bold, int size);
+void fb_text_measure(const char *s, int size, int *width, int *height);
+
+#define FB_TEXT_SHADOW 0x01
+#define FB_TEXT_OUTLINE 0x02 // one pixel around the glyphs
+#define FB_TEXT_BEVEL 0x04 // highlight up-left, lowlight down-right
+
+typedef struct {
+	int effects;
+	int shadow, outline, highlight, lowlight; // colors
+	int shadow_dx, shadow_dy;
+} fb_text_fx_t;
+
+void fb_text_fx(int x, int y, const char *s, int color, int bold, int size, const fb_text_fx_t *fx);
+
+// antialiased text height pixels tall, width scales with it
+void fb_text_sdf(int x, int y, const char *s, int color, int bold, int height);
+
+void fb_glyph_cache_limit(size_t bytes);
+void fb_glyph_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes);
 
 void fb_fill_rect(int x, int y, int width, int height, unsigned int color);
 void fb_fill_round_rect(int x, int y, int width, int height, unsigned int color, int corner);
 void fb_fill_oval(int x, int y, int width, int height, unsigned int color);
 void fb_fill_circle(int x, int y, int radius, unsigned int color);
 
+void fb_fill_polygon(const int *points, int n, unsigned int color, int nonzero);
+void fb_fill_triangle(int x1, int y1, int x2, int y2, int x3, int y3, unsigned int color);
+
+void fb_fill_gradient_linear(int x, int y, int width, int height, unsigned int color1, unsigned int color2, int vertical, int dither);
+void fb_fill_gradient_radial(int x, int y, int width, int height, int cx, int cy, int radius, unsigned int color1, unsigned int color2, int dither);
+
 void fb_draw_line(int x1, int y1, int x2, int y2, unsigned int color, int weight);
 
 void fb_draw_rect(int x, int y, int width, int height, unsigned int color, int weight);
@@ -51,6 +81,27 @@ void fb_draw_oval(int x, int y, int width, int height, unsigned int color, int w
 void fb_draw_circle(int x, int y, int radius, unsigned int color, int weight);
 
 void fb_draw_point(int x, int y, unsigned int color);
+void fb_draw_points(const int *points, const unsigned int *colors, int n);
+void fb_draw_row(int x, int y, const unsigned int *colors, int n);
+void fb_put_row(int x, int y, const void *pixels, int n);
+
+typedef struct fb_sprite fb_sprite_t;
+
+fb_sprite_t *fb_sprite_new(int width, int height);
+void fb_sprite_free(fb_sprite_t *sprite);
+void fb_sprite_target(fb_sprite_t *sprite);
+int fb_sprite_width(const fb_sprite_t *sprite);
+int fb_sprite_height(const fb_sprite_t *sprite);
+void fb_draw_sprite(int x, int y, const fb_sprite_t *sprite);
+
+typedef struct fb_text_run fb_text_run_t;
+
+fb_text_run_t *fb_text_run_new(int color, int bold, int size);
+void fb_text_run_free(fb_text_run_t *run);
+int fb_text_run_set(fb_text_run_t *run, const char *s);
+void fb_draw_text_run(int x, int y, fb_text_run_t *run);
+int fb_text_run_width(const fb_text_run_t *run);
+int fb_text_run_height(const fb_text_run_t *run);
 
 static inline double microtime() {
 	struct timeval tp = {0};
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pty.h>
+#include <time.h>
+
+// Plays fbrussia through a pty on the headless backend: starts a game,
+// types moves at a fixed interval and quits, so the game prints its
+// latency report (-s) as it would for a player at a console.
+
+static void sleep_ms(int ms) {
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+
+	while(nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static void type(int fd, const char *s) {
+	if(write(fd, s, strlen(s)) < 0) perror("write");
+}
+
+int main(int argc, char *argv[]) {
+	const char *moves[] = {"\033[D", "\033[D", "\033[C", "\033[C", "\033[A", "\033[B"};
+	const char *game = "./fbrussia", *device = "mem:1024x768", *trace = NULL;
+	int keys = 200, interval = 30, opt, status, i;
+	int master, slave, null;
+	pid_t pid;
+
+	while((opt = getopt(argc, argv, "n:i:g:l:")) != -1) {
+		switch(opt) {
+			case 'n': // keys to type
+				keys = atoi(optarg);
+				break;
+			case 'i': // ms between keys
+				interval = atoi(optarg);
+				break;
+			case 'g':
+				game = optarg;
+				break;
+			case 'l': // per-key records from the game
+				trace = optarg;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n keys] [-i ms] [-g fbrussia] [-l latency.csv] [device]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind < argc) device = argv[optind];
+
+	if(openpty(&master, &slave, NULL, NULL, NULL)) {
+		perror("openpty");
+		return 1;
+	}
+
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if(pid == 0) { // the pty is the game's terminal, its report goes to our stderr
+		setsid();
+		dup2(slave, 0);
+		null = open("/dev/null", O_WRONLY);
+		if(null >= 0) dup2(null, 1);
+		close(master);
+		close(slave);
+
+		if(trace) execl(game, game, "-s", "-l", trace, device, (char*) NULL);
+		else execl(game, game, "-s", device, (char*) NULL);
+		perror(game);
+		_exit(127);
+	}
+	close(slave);
+
+	sleep_ms(300); // raw mode and the first frame
+	type(master, "[");
+	for(i = 0; i < keys; i ++) {
+		sleep_ms(interval);
+		type(master, moves[i % (sizeof(moves) / sizeof(moves[0]))]);
+	}
+	sleep_ms(300);
+	type(master, "q");
+
+	if(waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return 1;
+	}
+	close(master);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -270,11 +270,14 @@ static unsigned char font_08x14_data[] = {
 	0x15,0x82,0x2d,0x82,0x0a,0x82,0x3a,0x82,0x11,0x82,0x05,0x82,0x04,0x83,0x14,
 	0x00
 };
+static unsigned int font_08x14_rows[96 * 28];
+
 static font_t font_08x14 = {
 	.width = 768,
 	.height = 28,
 	.cwidth = 8,
 	.cheight = 14,
 	.pixdata = font_08x14_data,
-	.rundata = NULL
+	.rowbits = font_08x14_rows,
+	.glyphs = 96
 };
@@ -200,11 +200,14 @@ static unsigned char font_10x18_data[] = {
 	0x84,0x3f,
 	0x00,
 };
+static unsigned int font_10x18_rows[96 * 18];
+
 static font_t font_10x18 = {
 	.width = 960,
 	.height = 18,
 	.cwidth = 10,
 	.cheight = 18,
 	.pixdata = font_10x18_data,
-	.rundata = NULL
+	.rowbits = font_10x18_rows,
+	.glyphs = 96
 };
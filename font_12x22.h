@@ -457,11 +457,14 @@ static unsigned char font_12x22_data[] = {
 	0x26,
 	0x00
 };
+static unsigned int font_12x22_rows[96 * 44];
+
 static font_t font_12x22 = {
 	.width = 1152,
 	.height = 44,
 	.cwidth = 12,
 	.cheight = 22,
 	.pixdata = font_12x22_data,
-	.rundata = NULL
+	.rowbits = font_12x22_rows,
+	.glyphs = 96
 };
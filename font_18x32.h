@@ -734,11 +734,14 @@ static unsigned char font_18x32_data[] = {
 	0x7f,0x7f,0x7f,0x7f,0x7f,0x7f,0x7f,0x7f,0x7f,0x26,
 	0x00
 };
+static unsigned int font_18x32_rows[96 * 64];
+
 static font_t font_18x32 = {
 	.width = 1728,
 	.height = 64,
 	.cwidth = 18,
 	.cheight = 32,
 	.pixdata = font_18x32_data,
-	.rundata = NULL
+	.rowbits = font_18x32_rows,
+	.glyphs = 96
 };
@@ -9,6 +9,9 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -18,41 +21,208 @@
 
 #include "fb.h"
 #include "api.h"
+#include "core.h"
+#include "bot.h"
 
 volatile unsigned int is_running = 1;
 
+#define FRAME_NS 40000000ull // 40ms
+
+// delayed auto-shift and its repeat rate, ns
+static unsigned long long dasDelay = 167000000ull, arrRepeat = 33000000ull;
+static unsigned long long keyTime; // read time of the key being handled
+
 void game_key(int key);
 void game_init(void);
 void game_render(void);
 void game_timer(void);
-void game_alrm(void);
+void game_frame(unsigned long long now);
+void game_gravity(unsigned long long now);
+void game_seed(unsigned long long seed, bool bag);
+void game_input(void);
+int game_bench(int threads);
+static void game_free_sprites(void);
+static void game_free_text(void);
+static void game_loop(bool stats);
+static void game_replay(double speed, bool stats);
+static void game_digest(void);
+static void game_bench_bot(int threads);
+
+// Sessions: -r records the seed, the randomizer, the shift timing and every key, gravity
+// tick and busy frame with the time the game saw; -p plays one back through
+// the same handlers at -x times the original pace (0 => no waiting). Each
+// record is a varint of the ns since the previous one << 2 | type, keys
+// followed by a varint of the key.
+#define SESSION_MAGIC "FBRS\2"
+enum {SESSION_KEY, SESSION_GRAVITY, SESSION_FRAME};
+
+static FILE *recFile, *playFile;
+static int evFd = -1; // -e keyboard, next to stdin
+static int botThreads = -1; // -a, the bot plays with this many search threads
+#define BOT_BEAM 8
+#define BOT_DEPTH 3
+static unsigned long long recTime;
+
+static void session_put(FILE *fp, unsigned long long v) {
+	for(; v >= 0x80; v >>= 7) fputc(v | 0x80, fp);
+	fputc(v, fp);
+}
+
+// 1 with v, 0 at the end of the file, -1 inside a varint
+static int session_get(FILE *fp, unsigned long long *v) {
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		c = fgetc(fp);
+		if(c == EOF) return shift ? -1 : 0;
+		if(shift > 63) return -1;
+		*v |= (unsigned long long) (c & 0x7f) << shift;
+		shift += 7;
+	} while(c & 0x80);
+
+	return 1;
+}
+
+static void game_record(int type, unsigned long long ns, int key) {
+	if(recFile == NULL) return;
+
+	if(recTime == 0) recTime = ns;
+	session_put(recFile, (ns - recTime) << 2 | type);
+	if(type == SESSION_KEY) session_put(recFile, key);
+	recTime = ns;
+}
+
+// fb_sync() that also puts the traced keys on screen
+static void game_sync(void) {
+	fb_sync();
+	trace_sync();
+}
 
 static void signal_handler(int sig) {
 	switch(sig) {
 		case SIGPIPE:
-		case SIGTERM:
-		case SIGINT:
 			is_running = 0;
 			break;
-		case SIGALRM:
-			if(is_running) game_alrm();
-			break;
 		default:
 			dprintf("SIG: %d\n", sig);
 	}
 }
 
 int main(int argc, char *argv[]) {
-	int ret;
+	int ret, opt;
+	int threads = 1;
+	bool bench = false, stats = false, bag = false;
+	const char *trace = NULL, *record = NULL, *play = NULL, *keyboard = NULL;
+	unsigned long long seed = time(NULL), v[4];
+	double speed = 1;
+	sigset_t set;
+
+	while((opt = getopt(argc, argv, "j:bsl:D:R:r:p:x:e:7a:")) != -1) {
+		switch(opt) {
+			case 'j': // raster threads, 0 => all cores
+				threads = atoi(optarg);
+				break;
+			case 'b':
+				bench = true;
+				break;
+			case 's': // tick, input and latency statistics on exit
+				stats = true;
+				break;
+			case 'l': // per-key latency records
+				trace = optarg;
+				break;
+			case 'D': // ms a left/right is held before it auto-shifts
+				dasDelay = atoi(optarg) * 1000000ull;
+				break;
+			case 'R': // ms between auto-shift moves, 0 => straight to the wall
+				arrRepeat = atoi(optarg) * 1000000ull;
+				break;
+			case 'r': // record the session
+				record = optarg;
+				break;
+			case 'p': // play a recorded session
+				play = optarg;
+				break;
+			case 'x': // playback speed, 0 => as fast as possible
+				speed = atof(optarg);
+				break;
+			case 'e': // keys from /dev/input/eventN too, with releases
+				keyboard = optarg;
+				break;
+			case '7': // 7-bag: every piece once in each seven
+				bag = true;
+				break;
+			case 'a': // the bot plays, with this many search threads, 0 => all cores
+				botThreads = max(0, atoi(optarg));
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-j threads] [-b] [-s] [-l latency.csv] [-D das ms] [-R arr ms] [-r session] [-p session [-x speed]] [-e keyboard] [-7] [-a bot threads] [device]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if(bench) return game_bench(threads);
+
+	if(play) {
+		char magic[sizeof(SESSION_MAGIC) - 1];
 
-	if(argc >= 2) ret = fb_init(argv[1]);
+		playFile = fopen(play, "rb");
+		if(playFile == NULL) {
+			perror(play);
+			return 1;
+		}
+		if(fread(magic, sizeof(magic), 1, playFile) != 1 || memcmp(magic, SESSION_MAGIC, sizeof(magic))
+			|| session_get(playFile, &v[0]) <= 0 || session_get(playFile, &v[1]) <= 0
+			|| session_get(playFile, &v[2]) <= 0 || session_get(playFile, &v[3]) <= 0) {
+			fprintf(stderr, "%s: not a session\n", play);
+			fclose(playFile);
+			return 1;
+		}
+		seed = v[0];
+		bag = v[1];
+		dasDelay = v[2];
+		arrRepeat = v[3];
+	}
+	if(record) {
+		recFile = fopen(record, "wb");
+		if(recFile == NULL) {
+			perror(record);
+			return 1;
+		}
+		fwrite(SESSION_MAGIC, sizeof(SESSION_MAGIC) - 1, 1, recFile);
+		session_put(recFile, seed);
+		session_put(recFile, bag);
+		session_put(recFile, dasDelay);
+		session_put(recFile, arrRepeat);
+	}
+	game_seed(seed, bag); // once, so later games follow from the session's seed
+
+	if(keyboard && (evFd = init_evdev(keyboard)) < 0) {
+		perror(keyboard);
+		return 1;
+	}
+
+	if(optind < argc) ret = fb_init(argv[optind]);
 	else ret = fb_init("/dev/fb0");
 	
 	if(ret == FB_ERR) return 1;
 
+	// SIGINT, SIGTERM and SIGUSR1 only arrive through the loop's signalfd;
+	// the raster and bot workers start with them blocked too.
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	if(threads != 1 && fb_threads(threads) == FB_ERR) eprintf("raster threads failed\n");
+	if(botThreads >= 0 && !playFile && bot_init(botThreads, BOT_BEAM, BOT_DEPTH)) {
+		eprintf("bot threads failed\n");
+		botThreads = 1;
+	}
+
 	signal(SIGPIPE, signal_handler);
-	signal(SIGTERM, signal_handler);
-	signal(SIGINT, signal_handler);
 
 	if(fb_save() == FB_ERR) eprintf("save failed\n");
 	
@@ -72,39 +242,57 @@ int main(int argc, char *argv[]) {
 	fflush(stdout);
 
 	game_init();
-	
-	signal(SIGALRM, signal_handler);
-	game_timer();
+	if(playFile) game_replay(speed, stats);
+	else game_loop(stats);
+	if(stats) game_digest();
+	if(stats && botThreads >= 0 && !playFile) {
+		bot_stats_t bs;
+
+		bot_stats(&bs);
+		fprintf(stderr, "bot: %lu plans, %llu placements evaluated, %.2lfM/s, plan avg %.3lfms\n", bs.plans, bs.evals,
+			bs.ns ? bs.evals * 1e3 / bs.ns : 0, bs.plans ? bs.ns / 1e6 / bs.plans : 0);
+	}
 
-	while(is_running) {
-		ret = read_key(1);
-		if(ret > 0) {
-			game_key(ret);
-		} else if(ret < 0) {
-			is_running = 0;
-		}
-	};
 	fprintf(stdout, "\033[?25h"); // show cursor
 	fflush(stdout);
 
 	restore_key();
 
+	if(trace && trace_dump(trace)) eprintf("latency records failed\n");
+	if(recFile && fclose(recFile)) eprintf("session record failed\n");
+	if(playFile) fclose(playFile);
+	free_evdev(evFd);
+	bot_free();
+
+	game_free_sprites();
+	game_free_text();
+
 	if(fb_restore() == FB_ERR) eprintf("restore failed\n");
 
 	fb_free();
 	return 0;
 }
 
-void game_timer(void) {
-	struct itimerval itv;
-
-	itv.it_interval.tv_sec = itv.it_value.tv_sec = 0;
-	itv.it_interval.tv_usec = itv.it_value.tv_usec = 40000; // 40ms
+// keys queued since the last wakeup, in order
+void game_input(void) {
+	key_event_t ev;
 
-	setitimer(ITIMER_REAL, &itv, NULL);
+	while(is_running && pop_input(&ev)) {
+		if(ev.key < 0) {
+			is_running = 0; // input closed
+		} else {
+			trace_key(&ev);
+			game_record(SESSION_KEY, ev.ns, ev.key);
+			keyTime = ev.ns;
+			game_key(ev.key);
+			keyTime = 0;
+			trace_end();
+		}
+	}
 }
 
 void game_key_trans(void);
+void game_shift(int dir, int flags);
 void game_key_left(void);
 void game_key_right(void);
 void game_key_down(void);
@@ -113,35 +301,45 @@ void game_start(void);
 void game_pause(void);
 
 void game_key(int key) {
+	int flags = key & (KEY_PRESS | KEY_RELEASE | KEY_REPEAT);
+
+	key &= ~flags;
+
+	// held keys
 	switch(key) {
-		case 0x1b:
-		case 'q':
-		case 'Q':
-			is_running = 0;
-			break;
-		case KEY_F1:
-		case '[': // start game
-			game_start();
-			break;
-		case KEY_F2:
-		case ']': // pause game
-			game_pause();
-			break;
 		case KEY_LEFT:
 		case '4':
 		case 'a':
 		case 'A':
 		case 'j':
 		case 'J': // left move
-			game_key_left();
-			break;
+			game_shift(-1, flags);
+			return;
 		case KEY_RIGHT:
 		case '6':
 		case 'd':
 		case 'D':
 		case 'l':
 		case 'L': // right move
-			game_key_right();
+			game_shift(1, flags);
+			return;
+	}
+	if(flags & KEY_RELEASE) return;
+
+	// pressed keys, held ones repeat
+	switch(key) {
+		case 0x1b:
+		case 'q':
+		case 'Q':
+			is_running = 0;
+			break;
+		case KEY_F1:
+		case '[': // start game
+			game_start();
+			break;
+		case KEY_F2:
+		case ']': // pause game
+			game_pause();
 			break;
 		case KEY_DOWN:
 		case '5':
@@ -169,13 +367,6 @@ void game_key(int key) {
 }
 
 #define WS_PX 15
-#define HEIGHT_SHAPE_NUM 20
-#define WIDTH_SHAPE_NUM 10
-#define MAX_GRADE 25
-static const int SHAPES[] = {0x4444, 0x4460, 0x2260, 0x0C60, 0x06C0, 0x0660, 0x04E0};
-static const int SHAPE_NUM = sizeof(SHAPES) / sizeof(int);
-static const int COLORS[] = {0x33, 0x66, 0x99, 0xcc};
-static const int COLOR_NUM = sizeof(COLORS) / sizeof(int);
 const char *HELPS[] = {
 	"      HELP    ",
 	"--------------",
@@ -190,59 +381,400 @@ const char *HELPS[] = {
 };
 const int HELPLEN = sizeof(HELPS) / sizeof(HELPS[0]);
 
-static int sX, sY, scoreNum, lineNum;
-static bool squareRecords[HEIGHT_SHAPE_NUM][WIDTH_SHAPE_NUM];
-static int colorRecords[HEIGHT_SHAPE_NUM][WIDTH_SHAPE_NUM];
-static int curShape, nextShape = 0;
-static int curColor, nextColor = 0;
-static bool beginGame, endGame, pauseGame;
-static int maxGrade = MAX_GRADE;
-static int idxGrade = 0;
+static core_t game; // the one being played
+static core_rand_t fxRand; // the banner, drawing it leaves the pieces alone
+static bool beginGame, pauseGame;
 static int overColor = 0;
 static int overOffset = 0;
 static int overStep = 1;
 
-void game_alrm(void) {
-	if(beginGame && (endGame || pauseGame)) {
-		PROF(game_render);
-	} else {
-		if(++idxGrade >= maxGrade) {
-			idxGrade = 0;
-			if(!beginGame || pauseGame || endGame) PROF(game_render);
-			else PROF(game_key_down);
+// Everything runs on this thread from one epoll loop: keys from stdin, a
+// frame tick and a gravity tick from timerfds on absolute CLOCK_MONOTONIC
+// deadlines, and SIGINT/SIGTERM/SIGUSR1 from a signalfd.
+static int frameFd = -1, gravityFd = -1;
+static unsigned long long gravityDue, gravityTick;
+static bool inGravity;
+
+static void game_arm(int fd, unsigned long long due, unsigned long long period) {
+	struct itimerspec its;
+
+	its.it_value.tv_sec = due / 1000000000ull;
+	its.it_value.tv_nsec = due % 1000000000ull;
+	its.it_interval.tv_sec = period / 1000000000ull;
+	its.it_interval.tv_nsec = period % 1000000000ull;
+
+	if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL)) pprintf("timerfd_settime");
+}
+
+// restarts the gravity period; from the gravity tick itself it runs on from
+// that tick's deadline so pieces fall without drift
+void game_timer(void) {
+	unsigned long long now = monotonic_ns(), period = game.grade * FRAME_NS;
+
+	if(gravityFd < 0) return;
+
+	if(inGravity && gravityTick + period > now) gravityDue = gravityTick + period;
+	else gravityDue = now + period;
+
+	game_arm(gravityFd, gravityDue, 0);
+}
+
+typedef struct {
+	unsigned long ticks, missed;
+	unsigned long long late_sum, late_sq, late_max; // ns past the deadline
+} tick_stats_t;
+
+static void tick_stat(tick_stats_t *st, unsigned long long due, unsigned long long expired) {
+	unsigned long long late = monotonic_ns() - due;
+
+	st->ticks ++;
+	st->missed += expired - 1;
+	st->late_sum += late;
+	st->late_sq += late * late / 1000; // us * ns keeps the sum in range
+	if(late > st->late_max) st->late_max = late;
+}
+
+static void tick_print(const char *name, const tick_stats_t *st) {
+	double avg = st->ticks ? st->late_sum / 1e3 / st->ticks : 0;
+	double sd = st->ticks ? sqrt(max(0, st->late_sq / 1e3 / st->ticks - avg * avg)) : 0;
+
+	fprintf(stderr, "%s: %lu ticks, %lu missed, late avg %.1lfus sd %.1lfus max %.1lfus\n", name, st->ticks, st->missed, avg, sd, st->late_max / 1e3);
+}
+
+static void game_loop(bool stats) {
+	struct epoll_event ev, evs[4];
+	struct signalfd_siginfo si;
+	unsigned long long expired, frameDue, now;
+	tick_stats_t frameStats = {0}, gravityStats = {0};
+	input_stats_t is;
+	sigset_t set;
+	int epfd, sigFd, i, n;
+	bool frame, gravity;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	sigFd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	frameFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	gravityFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(epfd < 0 || sigFd < 0 || frameFd < 0 || gravityFd < 0) {
+		pprintf("event loop");
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = 0;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev)) pprintf("epoll stdin");
+	ev.data.fd = evFd;
+	if(evFd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, evFd, &ev)) pprintf("epoll keyboard");
+	ev.data.fd = sigFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sigFd, &ev);
+	ev.data.fd = frameFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, frameFd, &ev);
+	ev.data.fd = gravityFd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, gravityFd, &ev);
+
+	frameDue = monotonic_ns() + FRAME_NS;
+	game_arm(frameFd, frameDue, FRAME_NS);
+	game_timer();
+
+	// keys are taken first on every wakeup, then gravity, then the frame
+	while(is_running) {
+		n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), input_wait());
+		if(n < 0) {
+			if(errno == EINTR) continue;
+
+			pprintf("epoll_wait");
+			break;
 		}
+
+		frame = gravity = false;
+		for(i = 0; i < n; i ++) {
+			if(evs[i].data.fd == 0) {
+				if(feed_input() < 0) epoll_ctl(epfd, EPOLL_CTL_DEL, 0, NULL); // the ring carries the error
+			} else if(evs[i].data.fd == evFd) {
+				if(feed_evdev(evFd) < 0) { // unplugged, stdin still plays
+					epoll_ctl(epfd, EPOLL_CTL_DEL, evFd, NULL);
+					free_evdev(evFd);
+					evFd = -1;
+				}
+			} else if(evs[i].data.fd == sigFd) {
+				if(read(sigFd, &si, sizeof(si)) != sizeof(si)) continue;
+
+				if(si.ssi_signo == SIGUSR1) trace_report(2); // latency so far
+				else is_running = 0;
+			} else if(read(evs[i].data.fd, &expired, sizeof(expired)) == sizeof(expired)) {
+				if(evs[i].data.fd == frameFd) {
+					frameDue += (expired - 1) * FRAME_NS;
+					tick_stat(&frameStats, frameDue, expired);
+					frameDue += FRAME_NS;
+					frame = true;
+				} else {
+					tick_stat(&gravityStats, gravityDue, expired);
+					gravity = true;
+				}
+			}
+		}
+		if(input_wait() == 0) feed_input(); // a lone ESC, its wait is over
+
+		game_input();
+		// a drop key re-arms gravity past its tick, the piece already fell
+		now = monotonic_ns();
+		if(is_running && gravity && gravityDue <= now) game_gravity(now);
+		if(is_running && frame) game_frame(monotonic_ns());
 	}
-	fb_sync();
+
+	if(stats) {
+		tick_print("frame", &frameStats);
+		tick_print("gravity", &gravityStats);
+
+		input_stats(&is);
+		fprintf(stderr, "input: %lu keys, %lu dropped, max depth %u, latency avg %.3lfms max %.3lfms\n", is.events, is.dropped, is.max_depth,
+			is.popped ? is.latency_sum / 1e6 / is.popped : 0, is.latency_max / 1e6);
+		trace_report(2);
+	}
+
+out:
+	if(gravityFd >= 0) close(gravityFd);
+	if(frameFd >= 0) close(frameFd);
+	if(sigFd >= 0) close(sigFd);
+	if(epfd >= 0) close(epfd);
+	gravityFd = frameFd = -1;
 }
 
-int game_rand_color() {
-	int r, g, b;
-	r = rand() % COLOR_NUM;
-	g = rand() % COLOR_NUM;
-	b = rand() % COLOR_NUM;
-	return fb_color(COLORS[r], COLORS[g], COLORS[b]);
+// Plays the session back on this thread: every record goes to the handler
+// that took it with the time it saw then, so the game runs the same at any
+// speed; only the pace of the frames on screen follows the speed.
+static void game_replay(double speed, bool stats) {
+	unsigned long long v, key = 0, ns = 0, first = 0, start = monotonic_ns(), t;
+	unsigned long events = 0;
+	struct timespec ts;
+	key_event_t ev;
+	sigset_t set;
+	int ret = 0;
+
+	while(is_running && (ret = session_get(playFile, &v)) > 0) {
+		ns += v >> 2;
+		if((v & 3) == SESSION_KEY && (ret = session_get(playFile, &key)) <= 0) break;
+		if(events ++ == 0) first = ns;
+
+		if(speed > 0) {
+			t = start + (ns - first) / speed;
+			ts.tv_sec = t / 1000000000ull;
+			ts.tv_nsec = t % 1000000000ull;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+
+		// SIGINT and SIGTERM stay blocked, no signalfd here
+		if(sigpending(&set) == 0 && (sigismember(&set, SIGINT) || sigismember(&set, SIGTERM))) break;
+
+		switch(v & 3) {
+			case SESSION_KEY: // traced from now, it was never queued
+				ev.key = key;
+				ev.ns = monotonic_ns();
+				trace_key(&ev);
+				keyTime = ns;
+				game_key(key);
+				keyTime = 0;
+				trace_end();
+				break;
+			case SESSION_GRAVITY:
+				game_gravity(ns);
+				break;
+			case SESSION_FRAME:
+				game_frame(ns);
+				break;
+		}
+	}
+	if(ret < 0 || ferror(playFile)) eprintf("session truncated after %lu records\n", events);
+
+	if(stats) {
+		t = monotonic_ns() - start;
+		fprintf(stderr, "replay: %lu records, %.3lfs of play in %.3lfs, %.0lf records/s\n", events, (ns - first) / 1e9, t / 1e9, t ? events * 1e9 / t : 0);
+		trace_report(2);
+	}
 }
 
-void game_reset(void) {
-	int x, y;
+// Delayed auto-shift for left and right. A press moves at once, as do the
+// terminal's repeats until dasDelay after the press; from then on the frame
+// tick shifts the piece every arrRepeat, all of a frame's moves in one
+// render. Terminals send no releases, so a key counts as held while its
+// repeats keep their cadence, and taps never auto-shift; keys from evdev
+// are held from their press to their release.
+#define SHIFT_DELAY_MAX 700000000ull // before a terminal's first repeat
+#define SHIFT_GAP_MAX 70000000ull // between repeats, longer gaps are taps
+#define SHIFT_RELEASE_MIN 60000000ull
+
+static struct {
+	int dir; // -1 left, 1 right, 0 none
+	bool held; // until its release, not by repeats
+	int repeats, moves; // moves done by auto-shift
+	unsigned long long press, seen, release; // ns
+	unsigned long long start; // auto-shift from here, 0 before
+} shift;
+
+void game_shift(int dir, int flags) {
+	unsigned long long ns = keyTime ? keyTime : monotonic_ns();
+	unsigned long long gap = ns - shift.seen;
+
+	if(flags & KEY_RELEASE) {
+		if(shift.dir == dir) memset(&shift, 0, sizeof(shift));
+		return;
+	}
+	if(flags & KEY_REPEAT) return; // the frame tick times the hold
+	if(flags & KEY_PRESS) {
+		memset(&shift, 0, sizeof(shift));
+		shift.dir = dir;
+		shift.held = true;
+		shift.press = shift.seen = ns;
+		shift.start = ns + dasDelay - arrRepeat; // the first auto-shift at dasDelay
+	} else if(shift.dir != dir || gap > (shift.repeats ? SHIFT_GAP_MAX : SHIFT_DELAY_MAX)) { // a new press
+		memset(&shift, 0, sizeof(shift));
+		shift.dir = dir;
+		shift.press = ns;
+	} else if(shift.repeats ++) { // the cadence is known from the second repeat
+		shift.release = max(SHIFT_RELEASE_MIN, 2 * gap);
+		if(shift.start) {
+			shift.seen = ns;
+			return; // the frame tick moves it
+		}
+		if(ns - shift.press >= dasDelay) shift.start = ns;
+	}
+	shift.seen = ns;
 
-	srand(time(NULL));
-	
-	beginGame = endGame = pauseGame = false;
-	maxGrade = MAX_GRADE;
-	idxGrade = 0;
-	sX = sY = 0;
-	curShape = 0;
-	curColor = 0;
-	if(nextShape == 0) nextShape = SHAPES[rand() % SHAPE_NUM];
-	if(nextColor == 0) nextColor = game_rand_color();
-	scoreNum = lineNum = 0;
-	for(y = 0; y < HEIGHT_SHAPE_NUM; y ++) {
-		for(x = 0; x < WIDTH_SHAPE_NUM; x ++) {
-			squareRecords[y][x] = false;
-			colorRecords[y][x] = 0;
+	if(dir < 0) game_key_left();
+	else game_key_right();
+}
+
+// the auto-shift moves due by now, true if the piece moved
+static bool game_autoshift(unsigned long long now) {
+	int due, moved = 0;
+
+	if(!shift.start || now < shift.start) return false;
+	if(!shift.held && now - shift.seen > shift.release) { // let go
+		shift.dir = 0;
+		shift.start = 0;
+		return false;
+	}
+	if(!beginGame || pauseGame || game.over) return false;
+
+	due = arrRepeat ? (now - shift.start) / arrRepeat : WIDTH_SHAPE_NUM;
+	for(; shift.moves < due; shift.moves ++) {
+		if(!core_move(&game, shift.dir, 0)) {
+			shift.moves = due; // at the wall, the next piece goes on from here
+			break;
 		}
+		moved ++;
+	}
+	return moved > 0;
+}
+
+// -a: the bot's keys, one a frame, typed as a player would and recorded the
+// same; after a game over it starts the next one a while later
+#define BOT_RESTART_NS 3000000000ull
+
+static struct {
+	int pieces; // game.pieces the move is for
+	bot_move_t move; // what is left of it
+	unsigned long long over; // when the game was seen over, ns
+} botPlay;
+
+static void game_bot_key(unsigned long long now, int key) {
+	game_record(SESSION_KEY, now, key);
+	keyTime = now;
+	game_key(key);
+	keyTime = 0;
+}
+
+static void game_bot(unsigned long long now) {
+	int key;
+
+	if(pauseGame) return;
+
+	if(!beginGame || game.over) {
+		if(botPlay.over == 0) botPlay.over = now;
+		if(beginGame && now - botPlay.over < BOT_RESTART_NS) return;
+
+		botPlay.over = 0;
+		game_bot_key(now, '[');
+		return;
+	}
+
+	if(botPlay.pieces != game.pieces) {
+		botPlay.pieces = game.pieces;
+		if(!bot_plan(&game, &botPlay.move)) memset(&botPlay.move, 0, sizeof(botPlay.move));
+	}
+
+	if(botPlay.move.turns) {
+		botPlay.move.turns --;
+		game_bot_key(now, KEY_UP);
+	} else if(botPlay.move.shift) { // pressed and let go, no auto-shift
+		key = botPlay.move.shift < 0 ? KEY_LEFT : KEY_RIGHT;
+		botPlay.move.shift += botPlay.move.shift < 0 ? 1 : -1;
+		game_bot_key(now, key | KEY_PRESS);
+		game_bot_key(now, key | KEY_RELEASE);
+	} else {
+		game_bot_key(now, ' ');
+	}
+}
+
+// auto-shift moves, and the paused and game over screens animate, every frame
+void game_frame(unsigned long long now) {
+	bool screen;
+
+	if(botThreads >= 0 && !playFile) game_bot(now);
+
+	screen = beginGame && (game.over || pauseGame);
+	if(!shift.start && !screen) return; // nothing to record either
+	game_record(SESSION_FRAME, now, 0);
+
+	if(game_autoshift(now) || screen) {
+		PROF(game_render);
+		game_sync();
 	}
+}
+
+void game_gravity(unsigned long long now) {
+	if(beginGame && (game.over || pauseGame)) return;
+	game_record(SESSION_GRAVITY, now, 0);
+
+	inGravity = true;
+	gravityTick = gravityDue;
+	if(!beginGame) PROF(game_render);
+	else PROF(game_key_down);
+	game_timer();
+	inGravity = false;
+
+	game_sync();
+}
+
+// the state a session ends in, the same for every replay of it
+static void game_digest(void) {
+	unsigned int h = 2166136261u;
+	int y;
+
+	for(y = 0; y < HEIGHT_SHAPE_NUM; y ++) h = (h ^ game.rows[y]) * 16777619u;
+
+	fprintf(stderr, "game: score %d lines %d shapes %04x %04x board %08x\n", game.score, game.lines, game.shape, PIECES[game.nextPiece].turns[0], h);
+}
+
+void game_seed(unsigned long long seed, bool bag) {
+	core_seed(&game, seed, bag);
+	core_rand_seed(&fxRand, ~seed, false);
+}
+
+// a core_rand_color() index as a pixel
+static int game_color(int i) {
+	i --;
+	return fb_color(COLORS[i / (COLOR_NUM * COLOR_NUM)], COLORS[i / COLOR_NUM % COLOR_NUM], COLORS[i % COLOR_NUM]);
+}
+
+void game_reset(void) {
+	beginGame = pauseGame = false;
+	core_reset(&game);
 
 	overColor = overOffset = 0;
 	overStep = 1;
@@ -251,7 +783,7 @@ void game_reset(void) {
 void game_init(void) {
 	game_reset();
 	game_render();
-	fb_sync();
+	game_sync();
 }
 
 void game_next_shape(void);
@@ -260,24 +792,24 @@ void game_start(void) {
 	beginGame = true;
 	game_next_shape();
 	game_render();
+	game_sync();
 }
 
 void game_pause(void) {
 	if(!beginGame) return;
 
 	pauseGame = !pauseGame;
-	idxGrade = 0;
 
 	overColor = overOffset = 0;
 	overStep = 1;
 
 	game_render();
-	fb_sync();
+	game_sync();
 
 	game_timer();
 }
 
-void game_draw(int x, int y, int side, int color) {
+static void game_draw_block(int x, int y, int side, int color) {
 	int addcolor = fb_color_add(color, 0x33);
 	int subcolor = fb_color_add(color, -0x33);
 #if 0
@@ -294,6 +826,90 @@ void game_draw(int x, int y, int side, int color) {
 	fb_fill_rect(x + 1, y + 1, side - 2, side - 2, color);
 }
 
+// bevelled blocks rasterized once per (color, side), core_rand_color() has COLOR_NUM^3 colors
+#define SPRITE_NUM 128
+static struct {
+	int color;
+	fb_sprite_t *sprite;
+} sprites[SPRITE_NUM];
+static int spriteSide = 0;
+
+// HUD strings laid out once, re-rendered only when their text changes
+enum {
+	RUN_SCORE,
+	RUN_SCORE_NUM,
+	RUN_LINE,
+	RUN_LINE_NUM,
+	RUN_GRADE,
+	RUN_GRADE_NUM,
+	RUN_CLOCK,
+	RUN_NUM
+};
+static fb_text_run_t *runs[RUN_NUM];
+
+static void game_free_sprites(void) {
+	int i;
+
+	for(i = 0; i < SPRITE_NUM; i ++) {
+		fb_sprite_free(sprites[i].sprite);
+		sprites[i].sprite = NULL;
+	}
+	spriteSide = 0;
+}
+
+static void game_free_text(void) {
+	int i;
+
+	for(i = 0; i < RUN_NUM; i ++) {
+		fb_text_run_free(runs[i]);
+		runs[i] = NULL;
+	}
+}
+
+static void game_text(int i, int x, int y, const char *s, int color, int bold) {
+	if(runs[i] == NULL) runs[i] = fb_text_run_new(color, bold, 1);
+
+	if(runs[i]) {
+		fb_text_run_set(runs[i], s);
+		fb_draw_text_run(x, y, runs[i]);
+	} else {
+		fb_text(x, y, s, color, bold, 1);
+	}
+}
+
+static fb_sprite_t *game_sprite(int side, int color) {
+	unsigned int i, h;
+
+	if(side != spriteSide) {
+		game_free_sprites();
+		spriteSide = side;
+	}
+
+	h = ((unsigned int) color * 2654435761u) % SPRITE_NUM;
+	for(i = 0; i < SPRITE_NUM; i ++, h = (h + 1) % SPRITE_NUM) {
+		if(sprites[h].sprite == NULL) break;
+		if(sprites[h].color == color) return sprites[h].sprite;
+	}
+	if(i == SPRITE_NUM) return NULL;
+
+	sprites[h].sprite = fb_sprite_new(side, side);
+	if(sprites[h].sprite == NULL) return NULL;
+	sprites[h].color = color;
+
+	fb_sprite_target(sprites[h].sprite);
+	game_draw_block(0, 0, side, color);
+	fb_sprite_target(NULL);
+
+	return sprites[h].sprite;
+}
+
+void game_draw(int x, int y, int side, int color) {
+	fb_sprite_t *sprite = game_sprite(side, color);
+
+	if(sprite) fb_draw_sprite(x, y, sprite);
+	else game_draw_block(x, y, side, color);
+}
+
 bool game_shape_point(int p, int x, int y) {
 	return (p & (1 << (16 - (x + 1 + y * 4))));
 }
@@ -321,43 +937,89 @@ int cal_pixel(complex c) {
 	return count - 0x24;
 }
 
+// a HUD line, run and run + 1 are its label and number; the label stays
+// and only the number is cleared, unless it starts past the line
+static void game_field(int run, int x, int y, int width, int height, const char *label, int value, int color, bool full) {
+	const int vx = x + fb_font_width() * 7;
+	char str[20];
+
+	if(full || vx >= x + width) {
+		fb_fill_rect(x, y, width, height, 0);
+		game_text(run, x + 3, y, label, 0xffcccccc, 0);
+	} else {
+		fb_fill_rect(vx, y, x + width - vx, height, 0);
+	}
+
+	sprintf(str, "%d", value);
+	game_text(run + 1, vx, y, str, color, 1);
+}
+
 static bool is_help = true;
+
+// what game_render() has on the canvas, it draws only what differs; the
+// help and a new size draw everything
+#define DRAWN_NONE 0xff
+static struct {
+	int side; // 0 => nothing
+	unsigned char cells[HEIGHT_SHAPE_NUM][WIDTH_SHAPE_NUM]; // colour, 0 empty
+	int nextPiece, nextColor;
+	int score, lines, grade;
+	time_t clock;
+	bool banner; // PAUSE/OVER floats over the board
+} drawn;
+
 void game_render(void) {
 	const int side = fb_height / (HEIGHT_SHAPE_NUM + 2);
 	const int X = (fb_width - (WIDTH_SHAPE_NUM + 5) * side) / 2, Y = (fb_height - HEIGHT_SHAPE_NUM * side) / 2;
 	const int X2 = X + (WIDTH_SHAPE_NUM + 1) * side;
 	const int bdcolor = 0xff666666;
+	const bool full = is_help || drawn.side != side, banner = beginGame && (game.over || pauseGame);
+	const time_t t = time(NULL);
 	int Y2 = Y;
 	int x, y;
-	int x2, y2;
+	int x2, y2, c;
 
-	fb_draw_rect(X - 3, Y - 3, WIDTH_SHAPE_NUM * side + 6, HEIGHT_SHAPE_NUM * side + 6, bdcolor, 1);
+	if(full) {
+		drawn.side = side;
+		fb_draw_rect(X - 3, Y - 3, WIDTH_SHAPE_NUM * side + 6, HEIGHT_SHAPE_NUM * side + 6, bdcolor, 1);
+	}
+	if(full || banner || drawn.banner) memset(drawn.cells, DRAWN_NONE, sizeof(drawn.cells));
+	drawn.banner = banner;
 
 	for(y = 0; y < HEIGHT_SHAPE_NUM; y ++) {
 		for(x = 0; x < WIDTH_SHAPE_NUM; x ++) {
+			if(ROW_CELL(game.rows[y], x)) c = game.colors[y][x];
+			else if(x >= game.x && x <= game.x + 3 && y >= game.y && y <= game.y + 3 && game_shape_point(game.shape, x - game.x, y - game.y)) c = game.color;
+			else c = 0;
+			if(c == drawn.cells[y][x]) continue;
+			drawn.cells[y][x] = c;
+
 			x2 = X + x * side;
 			y2 = Y + y * side;
-			if(squareRecords[y][x]) { // draw main box
-				game_draw(x2, y2, side, colorRecords[y][x]);
-			} else if(x >= sX && x <= sX + 3 && y >= sY && y <= sY + 3 && game_shape_point(curShape, x - sX, y - sY)) { // draw current shape
-				game_draw(x2, y2, side, curColor);
+			if(c) { // draw main box or current shape
+				game_draw(x2, y2, side, game_color(c));
 			} else { // draw main box
 				fb_fill_rect(x2, y2, side, side, 0xffffffff);
 			}
 		}
 	}
 
-	fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, 4 * side + 6, bdcolor, 1);
-
-	for(y = 0; y < 4; y ++) {
-		for(x = 0; x < 4; x ++) {
-			// draw next shape
-			x2 = X2 + x * side;
-			y2 = Y2 + y * side;
-			if(game_shape_point(nextShape, x, y)) {
-				game_draw(x2, y2, side, nextColor);
-			} else {
-				fb_fill_rect(x2, y2, side, side, 0xffffffff);
+	if(full) fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, 4 * side + 6, bdcolor, 1);
+
+	if(full || drawn.nextPiece != game.nextPiece || drawn.nextColor != game.nextColor) {
+		drawn.nextPiece = game.nextPiece;
+		drawn.nextColor = game.nextColor;
+
+		for(y = 0; y < 4; y ++) {
+			for(x = 0; x < 4; x ++) {
+				// draw next shape
+				x2 = X2 + x * side;
+				y2 = Y2 + y * side;
+				if(game_shape_point(PIECES[game.nextPiece].turns[0], x, y)) {
+					game_draw(x2, y2, side, game_color(game.nextColor));
+				} else {
+					fb_fill_rect(x2, y2, side, side, 0xffffffff);
+				}
 			}
 		}
 	}
@@ -368,35 +1030,34 @@ void game_render(void) {
 	
 	// draw scores, lines and grade
 	{
-		char str[20];
 		Y2 += side;
 		
-		fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, fb_font_height() * 4.0f + 6, bdcolor, 1);
+		if(full) fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, fb_font_height() * 4.0f + 6, bdcolor, 1);
 
 		Y2 += fb_font_height() * 0.2f;
 
-		sprintf(str, "%d", scoreNum);
-		fb_fill_rect(X2, Y2, 4 * side, fb_font_height(), 0);
-		fb_text(X2 + 3, Y2, "SCORE:", 0xffcccccc, 0, 1);
-		fb_text(X2 + fb_font_width() * 7, Y2, str, fb_color(0xff, 0x66, 0), 1, 1);
+		if(full || drawn.score != game.score) {
+			drawn.score = game.score;
+			game_field(RUN_SCORE, X2, Y2, 4 * side, fb_font_height(), "SCORE:", game.score, fb_color(0xff, 0x66, 0), full);
+		}
 
 		Y2 += fb_font_height() * 1.2f;
-		fb_fill_rect(X2 - 3, Y2 - 1, 4 * side + 6, 1, bdcolor);
+		if(full) fb_fill_rect(X2 - 3, Y2 - 1, 4 * side + 6, 1, bdcolor);
 		Y2 += fb_font_height() * 0.2f;
 
-		sprintf(str, "%d", lineNum);
-		fb_fill_rect(X2, Y2, 4 * side, fb_font_height() - 1, 0);
-		fb_text(X2 + 3, Y2, " LINE:", 0xffcccccc, 0, 1);
-		fb_text(X2 + fb_font_width() * 7, Y2, str, fb_color(0xff, 0x33, 0), 1, 1);
+		if(full || drawn.lines != game.lines) {
+			drawn.lines = game.lines;
+			game_field(RUN_LINE, X2, Y2, 4 * side, fb_font_height() - 1, " LINE:", game.lines, fb_color(0xff, 0x33, 0), full);
+		}
 
 		Y2 += fb_font_height() * 1.2f;
-		fb_fill_rect(X2 - 3, Y2 - 1, 4 * side + 6, 1, bdcolor);
+		if(full) fb_fill_rect(X2 - 3, Y2 - 1, 4 * side + 6, 1, bdcolor);
 		Y2 += fb_font_height() * 0.2f;
 
-		sprintf(str, "%d", MAX_GRADE + 1 - maxGrade);
-		fb_fill_rect(X2, Y2, 4 * side, fb_font_height() - 1, 0);
-		fb_text(X2 + 3, Y2, "GRADE:", 0xffcccccc, 0, 1);
-		fb_text(X2 + fb_font_width() * 7, Y2, str, fb_color(0xff, 0x33, 0), 1, 1);
+		if(full || drawn.grade != game.grade) {
+			drawn.grade = game.grade;
+			game_field(RUN_GRADE, X2, Y2, 4 * side, fb_font_height() - 1, "GRADE:", MAX_GRADE + 1 - game.grade, fb_color(0xff, 0x33, 0), full);
+		}
 
 		Y2 += fb_font_height() * 1.2f;
 	}
@@ -425,6 +1086,7 @@ void game_render(void) {
 		fb_draw_rect(x - 3, y - 3, x2 + 6, y2 + 6, bdcolor, 1);
 
 		for(i = 0; i < HELPLEN; i ++) fb_text(x, y + i * fh, HELPS[i], gray, 0, 1);
+		memset(drawn.cells, DRAWN_NONE, sizeof(drawn.cells)); // it may cover the board
 		
 		// Mandelbrot set
 		{
@@ -462,8 +1124,10 @@ void game_render(void) {
 			float scale_imag = (imag_max - imag_min) / fb_height;
 			int r, g, b;
 			int color;
+			unsigned int *row = (unsigned int*) malloc(w * 2 * sizeof(unsigned int));
+			unsigned int *row2 = row + w; // mirrored
 
-			for(y = 0; y < fb_height; y ++) {
+			for(y = 0; row && y < fb_height; y ++) {
 				c.imag = imag_min + ((float) y * scale_imag);
 				r = ((int) ((y + 1) * 255.0f / (float) fb_height)) & 0xff;
 				for(x = 0; x < w; x ++) {
@@ -474,43 +1138,30 @@ void game_render(void) {
 					b = mcolor;
 					// printf("%06x\n", b);
 
-					color = fb_color(b, g, r);
-					fb_draw_point(x, y, color);
-					fb_draw_point(x2 + w - 1 - x, y, color);
+					row[x] = row2[w - 1 - x] = fb_color(b, g, r);
 				}
+				fb_draw_row(0, y, row, w);
+				fb_draw_row(x2, y, row2, w);
 			}
+			free(row);
 		#undef mcolor
 		}
 		
 		// Gradual change: vertical
 		{
-			int r1 = 0xff, g1 = 0, b1 = 0;
-			int r2 = 0, g2 = 0xff, b2 = 0;
 			int w = Y / 2;
-			float rr = (float) (r2 - r1) / (float) fb_height, gg = (float) (g2 - g1) / (float) fb_height, bb = (float) (b2 - b1) / (float) fb_height;
-			float r, g, b;
-			int i;
 
-			for(i = 0, r = r1, g = g1, b = b1; i < fb_height; i ++, r += rr, g += gg, b += bb) {
-				fb_fill_rect(X - Y, i, w, 1, fb_color(r, g, b));
-				fb_fill_rect(fb_width - X - 1 + w, i, w, 1, fb_color(g, b, r));
-			}
+			fb_fill_gradient_linear(X - Y, 0, w, fb_height, fb_color(0xff, 0, 0), fb_color(0, 0xff, 0), 1, 1);
+			fb_fill_gradient_linear(fb_width - X - 1 + w, 0, w, fb_height, fb_color(0, 0, 0xff), fb_color(0xff, 0, 0), 1, 1);
 		}
 
 		// Gradual change: horizontal
 		{
-			int r1 = 0xff, g1 = 0, b1 = 0;
-			int r2 = 0, g2 = 0, b2 = 0xff;
 			int h = Y / 2;
 			int w = 2 * h + (WIDTH_SHAPE_NUM + 5) * side;
-			float rr = (float) (r2 - r1) / (float) w, gg = (float) (g2 - g1) / (float) w, bb = (float) (b2 - b1) / (float) w;
-			float r, g, b;
-			int i;
 
-			for(i = 0, r = r1, g = g1, b = b1; i < w; i ++, r += rr, g += gg, b += bb) {
-				fb_fill_rect(X - h + i, 0, 1, h, fb_color(r, g, b));
-				fb_fill_rect(X - h + w - 1 - i, fb_height - h, 1, h, fb_color(r, b, g));
-			}
+			fb_fill_gradient_linear(X - h, 0, w, h, fb_color(0xff, 0, 0), fb_color(0, 0, 0xff), 0, 1);
+			fb_fill_gradient_linear(X - h, fb_height - h, w, h, fb_color(0, 0xff, 0), fb_color(0xff, 0, 0), 0, 1);
 		}
 	}
 
@@ -518,26 +1169,31 @@ void game_render(void) {
 	
 	Y2 = Y + (HEIGHT_SHAPE_NUM - 5) * side;
 	
-	fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, 5 * side + 6, bdcolor, 1);
+	if(full) fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, 5 * side + 6, bdcolor, 1);
 	
-	// draw time
-	{
-		const time_t t = time(NULL);
+	// draw time, once a second
+	if(full || drawn.clock != t) {
 		struct tm tm;
 		const int radius = side * 2;
 		const int x0 = X2 + 2 * side, y0 = Y2 + 3 * side;
 		double angle;
 		int weight;
 
+		drawn.clock = t;
 		localtime_r(&t, &tm);
 		
 		{
 			char str[10];
 			sprintf(str, "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
-			x = X2 + (4 * side - fb_font_width() * 8) / 2;
-			y = Y2 + (side - fb_font_height()) / 2;
+			fb_text_measure(str, 1, &x2, &y2);
+			x = X2 + (4 * side - x2) / 2;
+			y = Y2 + (side - y2) / 2;
+			if(x2 > 4 * side) { // wider than the panel, over its border
+				fb_fill_rect(x, Y2, x2, side, 0);
+				fb_draw_rect(X2 - 3, Y2 - 3, 4 * side + 6, 5 * side + 6, bdcolor, 1);
+			}
 			fb_fill_rect(X2, Y2, 4 * side, side, 0);
-			fb_text(x, y, str, 0xffffffff, 0, 1);
+			game_text(RUN_CLOCK, x, y, str, 0xffffffff, 0);
 
 			fb_draw_rect(X2, Y2, 4 * side, side + 1, 0xffffffff, 1);
 		}
@@ -586,19 +1242,24 @@ void game_render(void) {
 	}
 	
 	fb_set_font(FONT_18x32);
-	if(beginGame && (endGame || pauseGame)) {
-		const char *str = endGame ? "OVER!" : "PAUSE";
-		const int sz = (WIDTH_SHAPE_NUM * side) / (fb_font_width() * strlen(str));
-		const int offset = (HEIGHT_SHAPE_NUM * side - fb_font_height() * sz) / 2;
-		const int step = offset / 1.5f / MAX_GRADE;
+	if(beginGame && (game.over || pauseGame)) {
+		const char *str = game.over ? "OVER!" : "PAUSE";
+		fb_text_fx_t fx = {0};
+		int sz, offset, step;
+
+		fb_text_measure(str, 1, &x2, &y2);
+		sz = (WIDTH_SHAPE_NUM * side) / x2;
+		offset = (HEIGHT_SHAPE_NUM * side - y2 * sz) / 2;
+		step = offset / 1.5f / MAX_GRADE;
 
-		if(overOffset == 0) overColor = game_rand_color();
+		if(overOffset == 0) overColor = game_color(core_rand_color(&fxRand));
 
-		x = X + (WIDTH_SHAPE_NUM * side - fb_font_width() * sz * strlen(str)) / 2;
+		x = X + (WIDTH_SHAPE_NUM * side - x2 * sz) / 2;
 		y = Y + offset + overOffset;
-		fb_text(x - 1, y - 1, str, fb_color_add(overColor, 0x33), 1, sz);
-		fb_text(x + 1, y + 1, str, fb_color_add(overColor, -0x33), 1, sz);
-		fb_text(x, y, str, overColor, 1, sz);
+		fx.effects = FB_TEXT_BEVEL;
+		fx.highlight = fb_color_add(overColor, 0x33);
+		fx.lowlight = fb_color_add(overColor, -0x33);
+		fb_text_fx(x, y, str, overColor, 1, sz, &fx);
 		
 		overOffset += step * overStep;
 		if(overStep > 0) {
@@ -613,190 +1274,260 @@ void game_render(void) {
 			}
 		}
 	}
-}
-
-int game_rotate_shape(int shape){
-	int s = 0, x, y;
-	for(y = 0; y < 4; y ++)
-		for(x = 0; x < 4; x ++)
-			if(game_shape_point(shape, 4 - y - 1, x))
-				s |= (1 << (16 - (x + 1 + y * 4)));
-	return s;
-}
-
-bool game_movable_shape(int shape, int X, int Y) {
-	int x, y;
-	for(y = 0; y < 4; y ++)
-		for(x = 0; x < 4; x ++)
-			if(game_shape_point(shape, x, y) && (X + x < 0 || X + x >= WIDTH_SHAPE_NUM || Y + y >= HEIGHT_SHAPE_NUM || (Y + y >= 0 && squareRecords[Y + y][X + x])))
-				return false;
-	return true;
-}
-
-void game_save_shape(void) {
-	int x, y, size = 0;
-	bool flag;
-	int idx = -1;
-	int stack[4];
-
-	for(y = 0; y < 4; y ++) {
-		if(sY + y < 0) continue;
-
-		for(x = 0; x < 4; x ++){
-			if(game_shape_point(curShape, x, y)){
-				squareRecords[sY + y][sX + x] = true;
-				colorRecords[sY + y][sX + x] = curColor;
-			}
-		}
-
-		flag = true;
-		for(x = 0; x < WIDTH_SHAPE_NUM; x ++) {
-			if(!squareRecords[sY + y][x]){
-				flag = false;
-				break;
-			}
-		}
-		if(flag) {
-			stack[++idx] = sY + y;
-		}
-	}
-	if(idx >= 0) {
-		scoreNum += (idx + 1) * 2 - 1;
-		lineNum += idx + 1;
-
-		dprintf("stack:");
-		for(y = 0; y <= idx; y ++)
-			dprintf(" %d", stack[y]);
-		dprintf("\n");
 
-		y = stack[idx --];
-		size = 1;
-		do {
-			while(idx >= 0 && y - size == stack[idx]) {
-				size++;
-				idx --;
-			}
-			for(x = 0; x < WIDTH_SHAPE_NUM; x ++){
-				squareRecords[y][x] = squareRecords[y - size][x];
-				colorRecords[y][x] = colorRecords[y - size][x];
-			}
-			y --;
-		} while(y - size >= 0);
-		for(; y >= 0; y--) {
-			for(x = 0; x < WIDTH_SHAPE_NUM; x++) {
-				squareRecords[y][x] = false;
-			}
-		}
-	}
+	trace_render();
 }
 
+// the next piece in play, or the game over screen
 void game_next_shape(void) {
-	if(endGame) return;
-	if(sY < 0) goto end;
+	if(game.over) return;
 
-	{
-		int x, y, mY = 0;
-		for(y = 3; y >= 0; y--) {
-			for(x = 0; x < 4; x++) {
-				if(game_shape_point(nextShape, x, y)) {
-					mY = max(mY, y);
-					break;
-				}
-			}
-		}
-		sX = (WIDTH_SHAPE_NUM - 4) / 2;
-		sY = -mY - 1;
-	}
-
-	if(!game_movable_shape(nextShape, sX, sY + 1)) {
-	end:
-		curShape = 0;
-		pauseGame = false;
-		endGame = true;
-
-		overColor = overOffset = 0;
-		overStep = 1;
-
-		return;
-	}
-	curShape = nextShape;
-	nextShape = SHAPES[rand() % SHAPE_NUM];
-	curColor = nextColor;
-	nextColor = game_rand_color();
-	{
-		maxGrade = MAX_GRADE - scoreNum / MAX_GRADE;
-		idxGrade = 0;
-		if(maxGrade < 1) maxGrade = 1;
+	if(core_spawn(&game)) {
 		game_timer();
+		return;
 	}
+	pauseGame = false;
+	overColor = overOffset = 0;
+	overStep = 1;
 }
 
 // transshape
 void game_key_trans(void) {
-	int shape;
-
-	if(!beginGame || pauseGame || endGame) return;
+	if(!beginGame || pauseGame || game.over) return;
 
-	shape = game_rotate_shape(curShape);
-	if(game_movable_shape(shape, sX, sY)) {
-		curShape = shape;
+	if(core_turn(&game)) {
 		game_render();
-		fb_sync();
+		game_sync();
 	}
 }
 
 // left move
 void game_key_left(void) {
-	if(!beginGame || pauseGame || endGame) return;
+	if(!beginGame || pauseGame || game.over) return;
 
-	if(game_movable_shape(curShape, sX - 1, sY)) {
-		sX --;
+	if(core_move(&game, -1, 0)) {
 		game_render();
-		fb_sync();
+		game_sync();
 	}
 }
 
 // right move
 void game_key_right(void) {
-	if(!beginGame || pauseGame || endGame) return;
+	if(!beginGame || pauseGame || game.over) return;
 
-	if(game_movable_shape(curShape, sX + 1, sY)) {
-		sX ++;
+	if(core_move(&game, 1, 0)) {
 		game_render();
-		fb_sync();
+		game_sync();
 	}
 }
 
 // down move
 void game_key_down(void) {
-	if(!beginGame || pauseGame || endGame) return;
+	if(!beginGame || pauseGame || game.over) return;
 
-	if(game_movable_shape(curShape, sX, sY + 1)) {
-		sY ++;
-	} else {
-		game_save_shape();
+	if(!core_move(&game, 0, 1)) {
+		core_lock(&game);
 		game_next_shape();
 	}
 
 	game_render();
-	fb_sync();
+	game_sync();
 
-	idxGrade = 0;
 	game_timer();
 }
 
 // fall
 void game_key_fall(void) {
-	if(!beginGame || pauseGame || endGame) return;
+	if(!beginGame || pauseGame || game.over) return;
 
-	while(game_movable_shape(curShape, sX, sY + 1))
-		sY++;
-
-	game_save_shape();
+	core_drop(&game);
+	core_lock(&game);
 	game_next_shape();
 
 	game_render();
-	fb_sync();
+	game_sync();
 }
 
+// the rules alone: collision tests, moves between the walls, turns,
+// placements that clear four lines and whole games, per second
+static void game_bench_logic(void) {
+	const int n = 4000000;
+	unsigned short rows[HEIGHT_SHAPE_NUM];
+	int i, k, x, y, d = 1, fits = 0, moved = 0, turned = 0, drawn = 0, placed = 0, lines = 0, games = 0;
+	double t[6];
+	core_t c;
 
+	// a ragged stack up to half height
+	game_reset();
+	for(y = HEIGHT_SHAPE_NUM / 2; y < HEIGHT_SHAPE_NUM; y ++)
+		for(x = 0; x < WIDTH_SHAPE_NUM; x ++)
+			if((x * 7 + y * 3) % 5) game.rows[y] |= 1 << (12 - x);
+
+	t[0] = microtime();
+	for(i = 0; i < n; i ++) fits += core_fits(&game, PIECES[i / 4 % SHAPE_NUM].turns[i % 4], i % 13 - 3, i / 13 % 23 - 3);
+	t[0] = microtime() - t[0];
+
+	t[1] = microtime();
+	for(i = 0, game.y = 6; i < n; i ++) {
+		if(i % 64 == 0) {
+			game.shape = PIECES[i / 256 % SHAPE_NUM].turns[i / 64 % 4];
+			game.x = 3;
+		}
+		if(core_move(&game, d, 0)) moved ++;
+		else d = -d;
+	}
+	t[1] = microtime() - t[1];
+
+	// spun on the stack, the kicks climb it
+	t[2] = microtime();
+	for(i = 0; i < n; i ++) {
+		if(i % 64 == 0) {
+			game.piece = i / 64 % SHAPE_NUM;
+			game.turn = 0;
+			game.shape = PIECES[game.piece].turns[0];
+			game.x = i / 64 % 7;
+			game.y = 8;
+		}
+		turned += core_turn(&game);
+	}
+	t[2] = microtime() - t[2];
+
+	// the bottom four rows full but for column 0, an I drops into it
+	game_reset();
+	for(y = HEIGHT_SHAPE_NUM - 4; y < HEIGHT_SHAPE_NUM; y ++) game.rows[y] = ROW_FULL & ~(1 << 12);
+	memcpy(rows, game.rows, sizeof(rows));
+	t[3] = microtime();
+	for(i = 0; i < n / 10; i ++) {
+		memcpy(game.rows, rows, sizeof(rows));
+		game.shape = 0x4444;
+		game.x = -1;
+		game.y = HEIGHT_SHAPE_NUM - 4;
+		core_lock(&game);
+	}
+	t[3] = microtime() - t[3];
+
+	// pieces from a 7-bag
+	core_rand_seed(&game.rand, 1, true);
+	t[4] = microtime();
+	for(i = 0; i < n; i ++) drawn += core_rand_piece(&game.rand);
+	t[4] = microtime() - t[4];
+
+	// whole games on a core of their own, each piece turned, shifted and
+	// dropped by its number, a new game as soon as one is over
+	core_seed(&c, 1, false);
+	t[5] = microtime();
+	for(i = 0; i < n / 4; i ++) {
+		if(!core_spawn(&c)) {
+			games ++;
+			core_reset(&c);
+			continue;
+		}
+		for(k = i % 4; k > 0; k --) core_turn(&c);
+		for(k = i * 7 % 11 - 5; k != 0 && core_move(&c, k < 0 ? -1 : 1, 0); k -= k < 0 ? -1 : 1);
+		core_drop(&c);
+		lines += core_lock(&c);
+		placed ++;
+	}
+	t[5] = microtime() - t[5];
+
+	printf("logic: %.1lfM collision tests/s (%d%% free) %.1lfM moves/s %.1lfM turns/s (%d%% turned) %.2lfM 4-line clears/s %.1lfM bag pieces/s (mean %.2lf)\n"
+		"logic: %.2lfM placements/s (%d games, %d lines)\n", n / t[0] / 1e6, (int) (fits * 100.0 / n), moved / t[1] / 1e6,
+		n / t[2] / 1e6, (int) (turned * 100.0 / n), n / 10 / t[3] / 1e6, n / t[4] / 1e6, (double) drawn / n,
+		placed / t[5] / 1e6, games, lines);
+	game_reset();
+}
+
+// the bot on a core of its own, 1 to threads search threads: the same
+// games each time, so the same lines
+static void game_bench_bot(int threads) {
+	const int pieces = 300;
+	bot_move_t m;
+	bot_stats_t st;
+	core_t c;
+	int n, i, games;
+
+	for(n = 1; n <= threads; n ++) {
+		if(bot_init(n, BOT_BEAM, BOT_DEPTH)) break;
+
+		core_seed(&c, 1, false);
+		for(i = games = 0; i < pieces; i ++) {
+			if(!core_spawn(&c)) {
+				games ++;
+				core_reset(&c);
+				continue;
+			}
+			if(!bot_plan(&c, &m)) break;
+			for(; m.turns; m.turns --) core_turn(&c);
+			for(; m.shift && core_move(&c, m.shift < 0 ? -1 : 1, 0); m.shift += m.shift < 0 ? 1 : -1);
+			core_drop(&c);
+			core_lock(&c);
+		}
+		bot_stats(&st);
+		if(st.plans == 0) {
+			printf("bot threads: %d no plan\n", n);
+			continue;
+		}
+
+		printf("bot threads: %d %.2lfM placements evaluated/s, plan %.3lfms, %d lines in %d pieces, %d games over\n", n, st.evals * 1e3 / st.ns,
+			st.ns / 1e6 / st.plans, c.lines, pieces, games);
+	}
+	bot_free();
+}
+
+// full frames at 1080p and 4K on the memory backend, 1 to threads raster threads
+int game_bench(int threads) {
+	const char *modes[] = {"mem:1920x1080", "mem:3840x2160"};
+	const int frames = 10;
+	double t, base = 0, moves[2];
+	int i, n, f;
+
+	game_bench_logic();
+
+	if(threads < 2) threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	game_bench_bot(threads);
+
+	for(i = 0; i < sizeof(modes) / sizeof(modes[0]); i ++) {
+		if(fb_init(modes[i]) == FB_ERR) return 1;
+
+		game_reset();
+
+		for(n = 1; n <= threads; n ++) {
+			if(fb_threads(n) == FB_ERR) break;
+
+			t = microtime();
+			for(f = 0; f < frames; f ++) {
+				is_help = true; // borders too, not only the board
+				game_render();
+				fb_flush();
+			}
+			t = (microtime() - t) / frames;
+			if(n == 1) base = t;
+
+			printf("%s threads: %d frame: %.3lfms speedup: %.2lf\n", modes[i] + 4, n, t * 1000.0f, base / t);
+		}
+
+		// a piece stepping sideways, only what changed against the whole screen
+		beginGame = true;
+		game.shape = PIECES[0].turns[0];
+		game.color = game.nextColor;
+		game.y = 4;
+		for(n = 0; n < 2; n ++) {
+			moves[n] = microtime();
+			for(f = 0; f < frames * 10; f ++) {
+				game.x = 3 + f % 2;
+				if(n) drawn.side = 0; // as before, everything every time
+				game_render();
+				fb_sync();
+			}
+			moves[n] = (microtime() - moves[n]) / frames / 10;
+		}
+		printf("%s move: %.3lfms full redraw: %.3lfms\n", modes[i] + 4, moves[0] * 1000.0f, moves[1] * 1000.0f);
+
+		game_free_sprites();
+		game_free_text();
+		fb_free();
+	}
+
+	return 0;
+}
@@ -91,18 +91,9 @@ int main(int argc, char *argv[]) {
 		BEGIN_TIME();
 
 		// Gradual change
-		{
-			int r1 = 0xff, g1 = 0, b1 = 0;
-			int r2 = 0, g2 = 0xff, b2 = 0;
-			float rr = (r2 - r1) / 100.0f, gg = (g2 - g1) / 100.0f, bb = (b2 - b1) / 100.0f;
-			float r, g, b;
-			int i;
-
-			for(i = 0, r = r1, g = g1, b = b1; i < 100; i ++, r += rr, g += gg, b += bb) {
-				fb_fill_rect(125, FB_H - 100 + i, 50, 1, fb_color(r, g, b));
-				fb_fill_rect(i, FB_H - 175, 1, 50, fb_color(r, g, b));
-			}
-		}
+		fb_fill_gradient_linear(125, FB_H - 100, 50, 100, fb_color(0xff, 0, 0), fb_color(0, 0xff, 0), 1, 1);
+		fb_fill_gradient_linear(0, FB_H - 175, 100, 50, fb_color(0xff, 0, 0), fb_color(0, 0xff, 0), 0, 1);
+		fb_fill_gradient_radial(FB_W - 100, 200, 100, 100, FB_W - 50, 250, 50, fb_color(0xff, 0xff, 0), fb_color(0, 0, 0xff), 1);
 
 		END_TIME();
 		BEGIN_TIME();
@@ -116,23 +107,40 @@ int main(int argc, char *argv[]) {
 		END_TIME();
 		BEGIN_TIME();
 		
-		// five-pointed star
+		// five-pointed star, the even-odd rule leaves the pentagon inside empty
 		{
 			int x = (FB_W / 2), y = (FB_H / 2);
 			int r = min(FB_W / 3, FB_H / 3);
-			int x1 = x, y1 = y - r;
-			int x2, y2;
+			int points[10];
 			int i;
 			double rad;
 
-			for(i = 144; i <= 720; i += 144 ) {
-				rad = (90 + i) * M_PI / 180.0;
-				x2 = r * cos(rad) + x;
-				y2 = - r * sin(rad) + y;
-				fb_draw_line(x1, y1, x2, y2, 0xff00ff00, 1);
-				x1 = x2;
-				y1 = y2;
+			for(i = 0; i < 5; i ++) {
+				rad = (90 + i * 144) * M_PI / 180.0;
+				points[i * 2] = r * cos(rad) + x;
+				points[i * 2 + 1] = - r * sin(rad) + y;
 			}
+			fb_fill_polygon(points, 5, 0xff00ff00, 0);
+		}
+
+		// hexagonal marker and arrow
+		{
+			int x = FB_W / 4, y = FB_H / 4;
+			int r = 40;
+			int hexagon[12];
+			int arrow[] = {
+				x + 60, y - 10, x + 100, y - 10, x + 100, y - 30, x + 140, y,
+				x + 100, y + 30, x + 100, y + 10, x + 60, y + 10
+			};
+			int i;
+
+			for(i = 0; i < 6; i ++) {
+				hexagon[i * 2] = x + r * cos(i * M_PI / 3);
+				hexagon[i * 2 + 1] = y + r * sin(i * M_PI / 3);
+			}
+			fb_fill_polygon(hexagon, 6, 0xff0000ff, 1);
+			fb_fill_polygon(arrow, 7, 0xff0000ff, 1);
+			fb_fill_triangle(x - 20, y + 60, x + 20, y + 60, x, y + 95, 0xffff00ff);
 		}
 
 		END_TIME();
@@ -140,6 +148,37 @@ int main(int argc, char *argv[]) {
 
 		fb_text(100, 75, "Hello World!", 0xff000000, 0, 1);
 		fb_text(100, 100, "Hello World!", 0xff000000, 1, 2);
+		{
+			fb_text_fx_t fx = {FB_TEXT_OUTLINE | FB_TEXT_SHADOW, 0xff333333, 0xff000000, 0, 0, 3, 3};
+
+			fb_text_fx(400, 100, "Hello World!", 0xffffff00, 1, 2, &fx);
+		}
+
+		END_TIME();
+		BEGIN_TIME();
+
+		{ // distance field text at sizes fb_text() can't reach
+			int i, y = 250;
+
+			for(i = 1; i <= 6; i ++) {
+				fb_text_sdf(100, y, "Hello World!", 0xff000000, 0, 11 * i + 5);
+				y += 11 * i + 10;
+			}
+		}
+
+		END_TIME();
+		BEGIN_TIME();
+
+		if(argc >= 3) { // console font, e.g. /usr/share/consolefonts/Uni2-Terminus16.psf
+			int family = fb_load_font(argv[2]);
+
+			if(family != FB_ERR) {
+				fb_set_font(family);
+				fb_text(100, 150, "Привет, мир! Grüße", 0xff000000, 0, 1);
+				fb_text(100, 175, "Привет, мир! Grüße", 0xff000000, 1, 2);
+				fb_set_font(FONT_12x22);
+			}
+		}
 
 		END_TIME();
 	}
@@ -153,6 +192,9 @@ int main(int argc, char *argv[]) {
 		double r = 1.0f, rad;
 		double angle = 1.0f;
 		double R = sqrt(pow(x0, 2) + pow(y0, 2));
+		int points[1024 * 2];
+		unsigned int colors[1024];
+		int n = 0;
 		do {
 			i++;
 			// dprintf("%d: %lf\n", i, angle);
@@ -160,11 +202,18 @@ int main(int argc, char *argv[]) {
 			r = 5.0f * rad;
 			x = x0 + r * cos(rad);
 			y = y0 - r * sin(rad);
-			if(x >= 0 && x < fb_width && y >= 0 && y < fb_height) fb_draw_point(round(x), round(y), color);
+			points[n * 2] = x;
+			points[n * 2 + 1] = y;
+			colors[n ++] = color;
+			if(n == 1024) {
+				fb_draw_points(points, colors, n);
+				n = 0;
+			}
 			rad = 360.0f / (2 * M_PI * r);
 			if(rad > 10.0f) angle += 10.0f;
 			else angle += rad;
 		} while(r < R);
+		fb_draw_points(points, colors, n);
 		dprintf("points: %d\n", i);
 	}
 	END_TIME();